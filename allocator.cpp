@@ -0,0 +1,138 @@
+#include "allocator.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+namespace entity {
+
+void* Heap_allocator::reallocate(void* ptr, size_t size, size_t new_size, size_t alignment)
+{
+	alignment = std::max(alignment, sizeof(void*));
+
+#ifdef _WIN32
+	(void)size;
+	if (!new_size)
+	{
+		_aligned_free(ptr);
+		return nullptr;
+	}
+	return _aligned_realloc(ptr, new_size, alignment);
+#else
+	void* new_ptr = nullptr;
+	if (new_size && posix_memalign(&new_ptr, alignment, new_size))
+		return nullptr;
+
+	if (ptr)
+	{
+		if (new_ptr)
+			memcpy(new_ptr, ptr, std::min(size, new_size));
+		free(ptr);
+	}
+	return new_ptr;
+#endif
+}
+
+Allocator& default_allocator()
+{
+	static Heap_allocator allocator;
+	return allocator;
+}
+
+Arena_allocator::Arena_allocator(size_t block_size, Allocator& parent)
+	: m_block_size(block_size)
+	, m_parent(&parent)
+{
+}
+
+Arena_allocator::~Arena_allocator()
+{
+	release();
+}
+
+// Returns the offset in [block] of the first address past its used bytes aligned to [alignment].
+static size_t align_offset(void const* block, size_t used, size_t alignment)
+{
+	const uintptr_t address = ((uintptr_t)block + used + alignment - 1) / alignment * alignment;
+	return address - (uintptr_t)block;
+}
+
+void* Arena_allocator::reallocate(void* ptr, size_t size, size_t new_size, size_t alignment)
+{
+	Block* block = m_blocks;
+
+	// If [ptr] is the last allocation of current block, it can be shrunk or grown in place.
+	const bool last = ptr && (char*)ptr + size == (char*)block + block->used;
+
+	if (last && (char*)ptr - (char*)block + new_size <= block->size)
+	{
+		block->used = (char*)ptr - (char*)block + new_size;
+		return new_size ? ptr : nullptr;
+	}
+
+	if (!new_size)
+		return nullptr;
+
+	// Shrinking, or nothing to do.
+	if (ptr && new_size <= size)
+		return ptr;
+
+	// Find room in current block or get a new one. Blocks are only aligned to `alignof(Block)`, so
+	// the absolute address is aligned, not the offset within the block.
+	size_t offset = block ? align_offset(block, block->used, alignment) : 0;
+
+	if (!block || offset + new_size > block->size)
+	{
+		const size_t min_block_size = sizeof(Block) + alignment + new_size;
+
+		// Look for a block emptied by `reset()` that fits, otherwise allocate a new one.
+		Block* new_block = nullptr;
+		for (Block** it = block ? &block->next : &m_blocks; *it; it = &(*it)->next)
+		{
+			if ((*it)->used == sizeof(Block) && (*it)->size >= min_block_size)
+			{
+				new_block = *it;
+				*it = new_block->next;
+				break;
+			}
+		}
+
+		if (!new_block)
+		{
+			const size_t block_size = std::max(m_block_size, min_block_size);
+			new_block = static_cast<Block*>(m_parent->allocate(block_size, alignof(Block)));
+			new_block->size = block_size;
+			new_block->used = sizeof(Block);
+		}
+
+		block = new_block;
+		block->next = m_blocks;
+		m_blocks = block;
+		offset = align_offset(block, block->used, alignment);
+	}
+
+	void* new_ptr = (char*)block + offset;
+	block->used = offset + new_size;
+
+	if (ptr)
+		memcpy(new_ptr, ptr, std::min(size, new_size));
+
+	return new_ptr;
+}
+
+void Arena_allocator::reset()
+{
+	for (Block* block = m_blocks; block; block = block->next)
+		block->used = sizeof(Block);
+}
+
+void Arena_allocator::release()
+{
+	while (m_blocks)
+	{
+		Block* next = m_blocks->next;
+		m_parent->deallocate(m_blocks, m_blocks->size, alignof(Block));
+		m_blocks = next;
+	}
+}
+
+} // namespace entity
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+namespace entity {
+
+// Interface of the allocator a Context makes all its allocations with, both for component
+// instances and its bookkeeping.
+class Allocator
+{
+public:
+	virtual ~Allocator() {}
+
+	// Reallocates the [size] bytes memory block [ptr] to [new_size] bytes aligned to [alignment],
+	// a power of two, preserving its content. A null [ptr] (and zero [size]) allocates a new block,
+	// a zero [new_size] frees the block and returns null.
+	virtual void* reallocate(void* ptr, size_t size, size_t new_size, size_t alignment) = 0;
+
+	// Allocates a new block of [size] bytes aligned to [alignment].
+	void* allocate(size_t size, size_t alignment) { return reallocate(nullptr, 0, size, alignment); }
+
+	// Frees the [size] bytes block [ptr], which can be null.
+	void deallocate(void* ptr, size_t size, size_t alignment) { if (ptr) reallocate(ptr, size, 0, alignment); }
+};
+
+// Allocator that allocates from the system heap.
+class Heap_allocator : public Allocator
+{
+public:
+	void* reallocate(void* ptr, size_t size, size_t new_size, size_t alignment) override;
+};
+
+// Returns the process wide instance of `Heap_allocator` used by default.
+Allocator& default_allocator();
+
+// Allocator that carves memory linearly out of large blocks requested to a parent allocator.
+// Memory is only released all at once by `reset()` or when the arena is destroyed, so that e.g.
+// backing a Context with its own arena makes tearing it down a single release and reusing the
+// memory for a new Context free of allocations.
+class Arena_allocator : public Allocator
+{
+public:
+	// Creates an arena that requests blocks of at least [block_size] bytes to [parent].
+	explicit Arena_allocator(size_t block_size = 1 << 20, Allocator& parent = default_allocator());
+
+	~Arena_allocator();
+
+	Arena_allocator(Arena_allocator const&) = delete;
+	Arena_allocator& operator=(Arena_allocator const&) = delete;
+
+	void* reallocate(void* ptr, size_t size, size_t new_size, size_t alignment) override;
+
+	// Makes all the memory allocated from the arena available again, keeping its blocks. Anything
+	// allocated from the arena, e.g. a Context, must have been destroyed.
+	void reset();
+
+	// Returns the arena blocks to the parent allocator.
+	void release();
+
+private:
+	// Header of a block of memory the arena allocates from.
+	struct Block
+	{
+		// Next block in the list.
+		Block* next;
+
+		// Size in bytes of the block, header included.
+		size_t size;
+
+		// Number of bytes used, header included.
+		size_t used;
+	};
+
+	// Blocks of the arena, the first one is the one currently allocated from.
+	Block* m_blocks = nullptr;
+
+	// Minimum size of a block.
+	size_t m_block_size;
+
+	// The allocator blocks are requested to.
+	Allocator* m_parent;
+};
+
+// Adapter of `Allocator` to the standard library allocator requirements, to use it with
+// standard containers. A default constructed adapter uses `default_allocator()`.
+template <typename T>
+struct Std_allocator
+{
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	Std_allocator() : allocator(&default_allocator()) {}
+
+	Std_allocator(Allocator* allocator) : allocator(allocator) {}
+
+	template <typename U>
+	Std_allocator(Std_allocator<U> const& other) : allocator(other.allocator) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(allocator->allocate(n * sizeof(T), alignof(T))); }
+
+	void deallocate(T* ptr, size_t n) { allocator->deallocate(ptr, n * sizeof(T), alignof(T)); }
+
+	template <typename U>
+	bool operator==(Std_allocator<U> const& other) const { return allocator == other.allocator; }
+
+	template <typename U>
+	bool operator!=(Std_allocator<U> const& other) const { return allocator != other.allocator; }
+
+	Allocator* allocator;
+};
+
+} // namespace entity
@@ -0,0 +1,229 @@
+#include "../entity.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+struct Position
+{
+	float x;
+	float y;
+};
+
+struct Velocity
+{
+	float x;
+	float y;
+};
+
+struct Health
+{
+	int h;
+};
+
+// Shared component giving each entity type of the foreach benchmark its own value, so that any
+// number of entity types can be defined at run time.
+struct Group
+{
+	uint32_t id;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Results the compiler must not optimize away.
+static volatile float sink;
+
+// Returns the milliseconds elapsed since [start].
+static double elapsed_ms(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Prints the result of a benchmark, with the counters of [context] when they are enabled.
+static void report(char const* name, double ms, uint64_t operations, entity::Context const& context)
+{
+	auto& counters = context.counters();
+	printf("%-36s %10.3f ms %10.2f ns/op", name, ms, ms * 1e6 / (double)std::max<uint64_t>(operations, 1));
+#ifdef ENTITY_COUNTERS
+	printf("  shifts %llu (%llu instances) reallocs %llu copied %llu KB", (unsigned long long)counters.range_shifts,
+		(unsigned long long)counters.shifted_instances, (unsigned long long)counters.reallocations, (unsigned long long)(counters.copied_bytes / 1024));
+
+	uint64_t foreach_time = 0;
+	for (auto time : context.foreach_times())
+		foreach_time += time;
+	if (foreach_time)
+		printf(" foreach %.3f ms", foreach_time / 1e6);
+#else
+	(void)counters;
+#endif
+	printf("\n");
+}
+
+// Creates and destroys entities in random order, with `create_n()` and `destroy_n()` batches and
+// one at a time.
+static void bench_churn(entity::Storage storage, char const* name)
+{
+	entity::Context context;
+	entity::Type types[] = { context.define<Position>(), context.define<Position, Velocity>(), context.define<Position, Velocity, Health>() };
+	context.setup(storage);
+
+	std::mt19937 rng(1);
+	std::vector<entity::Entity> entities;
+	std::vector<entity::Entity> batch(1000);
+	uint64_t operations = 0;
+
+	auto start = Clock::now();
+	for (uint32_t round = 0; round < 200; ++round)
+	{
+		for (auto type : types)
+		{
+			context.create_n(type, (uint32_t)batch.size(), batch.data());
+			entities.insert(entities.end(), batch.begin(), batch.end());
+		}
+
+		for (uint32_t i = 0; i < 500; ++i)
+			entities.push_back(context.create(types[rng() % 3]));
+
+		std::shuffle(entities.begin(), entities.end(), rng);
+
+		const size_t destroyed_count = entities.size() / 2;
+		context.destroy_n(entities.data() + entities.size() - destroyed_count, (uint32_t)destroyed_count);
+		entities.resize(entities.size() - destroyed_count);
+
+		for (uint32_t i = 0; i < 500 && !entities.empty(); ++i)
+		{
+			context.destroy(entities.back());
+			entities.pop_back();
+		}
+
+		operations += 3 * batch.size() + 500 + destroyed_count + 500;
+	}
+	report(name, elapsed_ms(start), operations, context);
+}
+
+// Runs a foreach over the same number of entities split over [type_count] entity types.
+static void bench_foreach(uint32_t type_count)
+{
+	const uint32_t entity_count = 1 << 20;
+
+	entity::Context context;
+	std::vector<entity::Type> types;
+	for (uint32_t i = 0; i < type_count; ++i)
+		types.push_back(context.define_shared<Position, Velocity>(Group{ i }));
+
+	entity::Foreach<Position, const Velocity> foreach_position_velocity;
+	context.define(foreach_position_velocity);
+	context.setup();
+
+	std::vector<entity::Entity> entities(entity_count / type_count);
+	for (auto type : types)
+	{
+		context.create_n(type, (uint32_t)entities.size(), entities.data());
+		for (auto entity : entities)
+			context.get<Velocity>(entity) = { 1.0f, 2.0f };
+	}
+
+	context.reset_counters();
+
+	const uint32_t rounds = 20;
+	auto start = Clock::now();
+	for (uint32_t round = 0; round < rounds; ++round)
+	{
+		context.foreach(foreach_position_velocity, [](Position& p, Velocity const& v)
+		{
+			p.x += v.x;
+			p.y += v.y;
+		});
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "foreach, %u entity types", type_count);
+	report(name, elapsed_ms(start), (uint64_t)rounds * entities.size() * type_count, context);
+}
+
+// Reads a component of entities in random order.
+static void bench_get()
+{
+	entity::Context context;
+	entity::Type types[] = { context.define<Position>(), context.define<Position, Velocity>(), context.define<Position, Health>() };
+	context.setup();
+
+	// Entities are created in batches: interleaving single creations of the types would shift
+	// the ranges each time with packed storage, see `bench_range_shift()`.
+	std::vector<entity::Entity> entities(3 << 18);
+	for (uint32_t i = 0; i < 3; ++i)
+		context.create_n(types[i], 1 << 18, entities.data() + (i << 18));
+
+	std::shuffle(entities.begin(), entities.end(), std::mt19937(2));
+	context.reset_counters();
+
+	float sum = 0.0f;
+	auto start = Clock::now();
+	for (auto entity : entities)
+		sum += context.get<Position>(entity).x;
+
+	report("get<T>, random order", elapsed_ms(start), entities.size(), context);
+	sink = sum;
+}
+
+// Fills a context and clears it, its cost should not depend on the number of entities.
+static void bench_clear()
+{
+	entity::Context context;
+	entity::Type types[] = { context.define<Position>(), context.define<Position, Velocity>(), context.define<Position, Velocity, Health>() };
+	context.setup();
+
+	std::vector<entity::Entity> entities(10000);
+	double ms = 0.0;
+	const uint32_t rounds = 1000;
+	for (uint32_t round = 0; round < rounds; ++round)
+	{
+		for (auto type : types)
+			context.create_n(type, (uint32_t)entities.size(), entities.data());
+
+		auto start = Clock::now();
+		context.clear();
+		ms += elapsed_ms(start);
+	}
+	report("clear(), 30000 entities", ms, rounds, context);
+}
+
+// Grows the first entity type of many sharing a component one entity at a time, which shifts
+// all the following ranges with packed storage.
+static void bench_range_shift(entity::Storage storage, char const* name)
+{
+	entity::Context context;
+	std::vector<entity::Type> types;
+	for (uint32_t i = 0; i < 100; ++i)
+		types.push_back(context.define_shared<Position>(Group{ i }));
+	context.setup(storage);
+
+	std::vector<entity::Entity> entities(1000);
+	for (auto type : types)
+		context.create_n(type, (uint32_t)entities.size(), entities.data());
+
+	context.reset_counters();
+
+	const uint32_t creations = 20000;
+	auto start = Clock::now();
+	for (uint32_t i = 0; i < creations; ++i)
+		context.create(types[0]);
+
+	report(name, elapsed_ms(start), creations, context);
+}
+
+int main()
+{
+	bench_churn(entity::Storage_packed, "create/destroy churn, packed");
+	bench_churn(entity::Storage_slack, "create/destroy churn, slack");
+
+	for (uint32_t type_count : { 1, 10, 100, 1000 })
+		bench_foreach(type_count);
+
+	bench_get();
+	bench_clear();
+
+	bench_range_shift(entity::Storage_packed, "range shift worst case, packed");
+	bench_range_shift(entity::Storage_slack, "range shift worst case, slack");
+}
@@ -2,395 +2,2774 @@
 #include "entity.h"
 #include <assert.h>
 #include <algorithm>
+#include <stdio.h>
+#include <string.h>
 
 namespace entity {
 
+// Adds [value] to the [counter] of `Counters` of [ctx] when ENTITY_COUNTERS is defined.
+#ifdef ENTITY_COUNTERS
+#define ENTITY_COUNT(ctx, counter, value) ((ctx).m_counters.counter += (value))
+#else
+#define ENTITY_COUNT(ctx, counter, value) ((void)0)
+#endif
+
 struct Context::Private
 {
+	// Returns the number of instances the specified component range can hold before it needs to
+	// grow.
 	static uint32_t get_range_capacity(Context const& ctx, Component const& component, uint32_t component_range_global_index)
 	{
+		auto& component_range = ctx.m_component_ranges[component_range_global_index];
+
+		if (ctx.m_storage == Storage_slack)
+		{
+			return component_range.capacity;
+		}
+		else if (component_range_global_index + 1 < component.ranges_first + component.ranges_count)
+		{
+			return ctx.m_component_ranges[component_range_global_index + 1].first_physical_index - component_range.first_physical_index;
+		}
+		else
+		{
+			return component.array_capacity - component_range.first_physical_index;
+		}
+	}
+
+	// Returns the alignment of the instance array of specified [component].
+	static size_t get_array_alignment(Context const& ctx, Component const& component)
+	{
+		return std::max<size_t>(std::max(component.alignment, ctx.m_range_alignment), sizeof(void*));
+	}
+
+	static range<Component_field const*> get_component_fields(Context const& ctx, Component const& component)
+	{
+		auto begin = ctx.m_component_fields.data() + component.fields_first;
+		return{ begin, begin + component.fields_count };
+	}
+
+	// Moves [count] instances of [component] from [src_index] to [dest_index], the source and
+	// destination may overlap.
+	static void move_instances(Context const& ctx, Component& component, uint32_t dest_index, uint32_t src_index, uint32_t count)
+	{
+		++component.version;
+		ENTITY_COUNT(ctx, copied_bytes, (uint64_t)count * component.instance_size);
+
+		for (auto& field : get_component_fields(ctx, component))
+		{
+			char* field_array = component.array + (size_t)component.array_capacity * field.offset;
+			memmove(field_array + dest_index * field.size, field_array + src_index * field.size, count * field.size);
+		}
+	}
+
+	// Rounds [count] instances of [component] up to the granularity of range starts.
+	static uint32_t round_to_range_granularity(Component const& component, uint32_t count)
+	{
+		return (count + component.range_granularity - 1) / component.range_granularity * component.range_granularity;
+	}
+
+	// Rounds [capacity] up to a valid capacity of the instance array of specified [component]. The
+	// capacity of components stored as structure of arrays is kept a multiple of the range alignment
+	// so that each field array is aligned too.
+	static uint32_t round_array_capacity(Context const& ctx, Component const& component, uint32_t capacity)
+	{
+		capacity = std::max(capacity, std::max(16U, component.range_granularity));
+		if (component.fields_count > 1 && ctx.m_range_alignment)
+			capacity = (capacity + ctx.m_range_alignment - 1) / ctx.m_range_alignment * ctx.m_range_alignment;
+		return capacity;
+	}
+
+	// Number of instances the range [component_range] of [component] is given when ranges are
+	// packed by `setup()` or `shrink_array()`.
+	static uint32_t get_packed_range_capacity(Context const& ctx, Component const& component, Component_range const& component_range)
+	{
+		auto& entity_type = ctx.m_entity_types[component_range.entity_type_index];
+		return round_to_range_granularity(component, std::max(entity_type.alive_count, entity_type.reserved_count));
+	}
+
+	// Grows the instance array of specified [component] geometrically so that it can hold at least
+	// [capacity] instances.
+	static void reserve_array(Context const& ctx, Component& component, uint32_t capacity)
+	{
+		if (capacity <= component.array_capacity)
+			return;
+
+		copy_mapped_array(ctx, component);
+
+		const uint32_t array_capacity = component.array_capacity;
+
+		while (capacity > component.array_capacity)
+			component.array_capacity *= 2;
+
+		++component.version;
+		ENTITY_COUNT(ctx, reallocations, 1);
+		ENTITY_COUNT(ctx, copied_bytes, (uint64_t)array_capacity * (component.instance_size + sizeof(uint32_t)));
+		component.array = (char*)ctx.m_allocator->reallocate(component.array, array_capacity * component.instance_size, component.array_capacity * component.instance_size, get_array_alignment(ctx, component));
+
+		// Move the arrays of separately stored fields to their new offset, last field first as they
+		// move up.
+		auto fields = get_component_fields(ctx, component);
+		for (auto field = fields.end(); field-- != fields.begin() + 1;)
+		{
+			memmove(component.array + (size_t)component.array_capacity * field->offset, component.array + (size_t)array_capacity * field->offset, array_capacity * field->size);
+		}
+		component.physical_to_logical = (uint32_t*)ctx.m_allocator->reallocate(component.physical_to_logical, array_capacity * sizeof(uint32_t), component.array_capacity * sizeof(uint32_t), alignof(uint32_t));
+	}
+
+	// Copies the arrays of [component] out of the mapped file, if it points into it.
+	static void copy_mapped_array(Context const& ctx, Component& component)
+	{
+		if (!component.mapped)
+			return;
+
+		char* array = (char*)ctx.m_allocator->allocate(component.array_capacity * component.instance_size, get_array_alignment(ctx, component));
+		uint32_t* physical_to_logical = (uint32_t*)ctx.m_allocator->allocate(component.array_capacity * sizeof(uint32_t), alignof(uint32_t));
+		memcpy(array, component.array, component.array_capacity * component.instance_size);
+		memcpy(physical_to_logical, component.physical_to_logical, component.array_capacity * sizeof(uint32_t));
+		ENTITY_COUNT(ctx, copied_bytes, (uint64_t)component.array_capacity * (component.instance_size + sizeof(uint32_t)));
+
+		component.array = array;
+		component.physical_to_logical = physical_to_logical;
+		component.mapped = false;
+	}
+
+	// Frees the arrays of [component], unless they point into the mapped file.
+	static void free_array(Context const& ctx, Component& component)
+	{
+		if (!component.mapped)
+		{
+			ctx.m_allocator->deallocate(component.array, component.array_capacity * component.instance_size, get_array_alignment(ctx, component));
+			ctx.m_allocator->deallocate(component.physical_to_logical, component.array_capacity * sizeof(uint32_t), alignof(uint32_t));
+		}
+
+		component.array = nullptr;
+		component.physical_to_logical = nullptr;
+		component.mapped = false;
+	}
+
+	// Slack storage version of `component_push_back()`. Each range owns a capacity that grows
+	// geometrically. A range that runs out of space is grown in place if it is the last one in the
+	// array, otherwise it is moved to the end of the array, leaving its old space unused. Other
+	// ranges are never touched, so the cost of growing a range is proportional to its own size
+	// only. The unused space is bounded by the sum of the ranges capacities.
+	static uint32_t component_push_back_slack(Context& ctx, Component& component, uint32_t component_range_global_index, uint32_t count)
+	{
+		auto& component_range = ctx.m_component_ranges[component_range_global_index];
+
+		const uint32_t alive_count = ctx.m_entity_types[component_range.entity_type_index].alive_count;
+
+		if (alive_count + count > component_range.capacity)
+		{
+			const uint32_t capacity = round_to_range_granularity(component, std::max(std::max(component_range.capacity * 2, alive_count + count), 16U));
+
+			if (component_range.first_physical_index + component_range.capacity == component.array_size)
+			{
+				// This is the last range in the array, simply grow it.
+				reserve_array(ctx, component, component_range.first_physical_index + capacity);
+			}
+			else
+			{
+				// Move the range to the end of the array.
+				const uint32_t first_physical_index = component.array_size;
+
+				reserve_array(ctx, component, first_physical_index + capacity);
+
+				move_instances(ctx, component, first_physical_index, component_range.first_physical_index, alive_count);
+				ENTITY_COUNT(ctx, range_shifts, 1);
+				ENTITY_COUNT(ctx, shifted_instances, alive_count);
+				ENTITY_COUNT(ctx, copied_bytes, (uint64_t)alive_count * sizeof(uint32_t));
+
+				// Update logical to physical index mapping of moved instances.
+				for (uint32_t i = 0; i < alive_count; ++i)
+				{
+					uint32_t logical_index = component.physical_to_logical[component_range.first_physical_index + i];
+					component_range.logical_to_physical[logical_index] = first_physical_index + i;
+					component.physical_to_logical[first_physical_index + i] = logical_index;
+				}
+
+				component_range.first_physical_index = first_physical_index;
+			}
+
+			component_range.capacity = capacity;
+			component.array_size = component_range.first_physical_index + capacity;
+		}
+
+		return component_range.first_physical_index + alive_count;
+	}
+
+	// Makes room for [count] instances of specified component at the back of its range, shifting
+	// the following ranges (at most once each) if there is not enough space. After this function
+	// returns, [count] empty instances are at the end of specified component range. The size of
+	// the range is not effected and the physical index of the first new instance is returned.
+	// Shifting a range moves all its instances to keep their order, so with packed storage a full
+	// range costs O(n) in the instances of all the following ranges. `Storage_slack` and
+	// `Context::reserve()` avoid it.
+	static uint32_t component_push_back(Context& ctx, Component& component, uint32_t component_range_global_index, uint32_t count)
+	{
+		if (ctx.m_storage == Storage_slack)
+			return component_push_back_slack(ctx, component, component_range_global_index, count);
+
+		auto& component_range = ctx.m_component_ranges[component_range_global_index];
+
+		uint32_t back_index = component_range.first_physical_index + ctx.m_entity_types[component_range.entity_type_index].alive_count;
+
 		if (component_range_global_index + 1 < component.ranges_first + component.ranges_count)
 		{
-			return ctx.m_component_ranges[component_range_global_index + 1].first_physical_index - ctx.m_component_ranges[component_range_global_index].first_physical_index;
+			// This range is followed by another range. See if the next range starts at least
+			// [count] instances away from this range last, which means we can insert our new
+			// instances without moving memory around.
+			auto& next_component_range = ctx.m_component_ranges[component_range_global_index + 1];
+
+			// If there's not enough space at the end of this range for [count] more instances...
+			if (back_index + count > next_component_range.first_physical_index)
+			{
+				const uint32_t shift = round_to_range_granularity(component, back_index + count - next_component_range.first_physical_index);
+				const uint32_t next_alive_count = ctx.m_entity_types[next_component_range.entity_type_index].alive_count;
+
+				// Make room for [shift] more at the end of next range.
+				component_push_back(ctx, component, component_range_global_index + 1, shift);
+
+				// Move all instances of the next range up by [shift], so that the range can start
+				// [shift] instances later. The order of the instances must be preserved: the ranges
+				// of an entity type hold the components of the same entity at the same position.
+				const uint32_t src_index = next_component_range.first_physical_index;
+				const uint32_t dest_index = src_index + shift;
+
+				move_instances(ctx, component, dest_index, src_index, next_alive_count);
+
+				memmove(component.physical_to_logical + dest_index,
+				        component.physical_to_logical + src_index,
+				        next_alive_count * sizeof(uint32_t));
+
+				ENTITY_COUNT(ctx, range_shifts, 1);
+				ENTITY_COUNT(ctx, shifted_instances, next_alive_count);
+				ENTITY_COUNT(ctx, copied_bytes, (uint64_t)next_alive_count * sizeof(uint32_t));
+
+				// Update logical to physical index mapping of moved instances.
+				for (uint32_t i = 0; i < next_alive_count; ++i)
+				{
+					next_component_range.logical_to_physical[component.physical_to_logical[dest_index + i]] = dest_index + i;
+				}
+
+				// Shift the next range up by [shift].
+				next_component_range.first_physical_index += shift;
+			}
+		}
+		else
+		{
+			// This is the last component range. We shall operate on the instances array itself,
+			// growing it if there's not enough space.
+			reserve_array(ctx, component, back_index + count);
 		}
+
+		return back_index;
+	}
+
+	// Makes room in each component range of [entity_type] for at least [count] entities, and in its
+	// index arrays.
+	static void reserve_entity_type(Context& ctx, Entity_type& entity_type, uint32_t count)
+	{
+		for (auto& component_ref : get_component_refs(ctx, entity_type))
+		{
+			auto& component = ctx.m_components[component_ref.component_index];
+
+			if (count > entity_type.alive_count && get_range_capacity(ctx, component, component_ref.component_range_global_index) < count)
+				component_push_back(ctx, component, component_ref.component_range_global_index, count - entity_type.alive_count);
+
+			ctx.m_component_ranges[component_ref.component_range_global_index].logical_to_physical.reserve(count);
+		}
+
+		entity_type.generation.reserve(count);
+	}
+
+	// Reallocates the instance array of [component] to the smallest capacity that holds all its
+	// ranges, packed in order and each keeping room for the entities reserved for its type.
+	static void shrink_array(Context& ctx, Component& component)
+	{
+		auto ranges = make_range(ctx.m_component_ranges.data() + component.ranges_first, component.ranges_count);
+
+		uint32_t size = 0;
+		for (auto& component_range : ranges)
+			size += get_packed_range_capacity(ctx, component, component_range);
+
+		const uint32_t array_capacity = round_array_capacity(ctx, component, size);
+		if (array_capacity >= component.array_capacity)
+			return;
+
+		++component.version;
+
+		char* array = (char*)ctx.m_allocator->allocate(array_capacity * component.instance_size, get_array_alignment(ctx, component));
+		uint32_t* physical_to_logical = (uint32_t*)ctx.m_allocator->allocate(array_capacity * sizeof(uint32_t), alignof(uint32_t));
+
+		uint32_t first_physical_index = 0;
+		for (auto& component_range : ranges)
+		{
+			const uint32_t alive_count = ctx.m_entity_types[component_range.entity_type_index].alive_count;
+
+			for (auto& field : get_component_fields(ctx, component))
+			{
+				memcpy(array + (size_t)array_capacity * field.offset + first_physical_index * field.size,
+				       component.array + (size_t)component.array_capacity * field.offset + component_range.first_physical_index * field.size,
+				       alive_count * field.size);
+			}
+
+			memcpy(physical_to_logical + first_physical_index, component.physical_to_logical + component_range.first_physical_index, alive_count * sizeof(uint32_t));
+			ENTITY_COUNT(ctx, copied_bytes, (uint64_t)alive_count * (component.instance_size + sizeof(uint32_t)));
+
+			// Update logical to physical index mapping of moved instances.
+			for (uint32_t i = 0; i < alive_count; ++i)
+				component_range.logical_to_physical[physical_to_logical[first_physical_index + i]] = first_physical_index + i;
+
+			component_range.first_physical_index = first_physical_index;
+			component_range.capacity = get_packed_range_capacity(ctx, component, component_range);
+			first_physical_index += component_range.capacity;
+		}
+
+		free_array(ctx, component);
+
+		component.array = array;
+		component.physical_to_logical = physical_to_logical;
+		component.array_capacity = array_capacity;
+		component.array_size = first_physical_index;
+	}
+
+	// Stamps all component ranges of [entity_type] with a new change version.
+	static void mark_entity_type_changed(Context& ctx, Entity_type const& entity_type)
+	{
+		++ctx.m_change_version;
+		for (auto& component_ref : get_component_refs(ctx, entity_type))
+			ctx.m_component_ranges[component_ref.component_range_global_index].change_version = ctx.m_change_version;
+	}
+
+	// Returns the array the free list of [entity_type] is threaded through.
+	static Vector<uint32_t>& get_free_list_links(Context& ctx, Entity_type const& entity_type)
+	{
+		return ctx.m_component_ranges[get_component_refs(ctx, entity_type).begin()->component_range_global_index].logical_to_physical;
+	}
+
+	// Appends [logical_index], which must not be used by any component range anymore, to the free
+	// list of [entity_type].
+	static void free_list_push(Context& ctx, Entity_type& entity_type, uint32_t logical_index)
+	{
+		auto& links = get_free_list_links(ctx, entity_type);
+
+		links[logical_index] = (uint32_t)-1;
+		if (entity_type.free_last == (uint32_t)-1)
+			entity_type.free_first = logical_index;
+		else
+			links[entity_type.free_last] = logical_index;
+
+		entity_type.free_last = logical_index;
+		++entity_type.free_count;
+	}
+
+	// Removes and returns the first index of the free list of [entity_type], which must not be
+	// empty.
+	static uint32_t free_list_pop(Context& ctx, Entity_type& entity_type)
+	{
+		assert(entity_type.free_count);
+		auto& links = get_free_list_links(ctx, entity_type);
+
+		const uint32_t logical_index = entity_type.free_first;
+		entity_type.free_first = links[logical_index];
+		if (entity_type.free_first == (uint32_t)-1)
+			entity_type.free_last = (uint32_t)-1;
+
+		--entity_type.free_count;
+		return logical_index;
+	}
+
+	// Returns the links of an entity without parent nor children.
+	static Hierarchy_node no_hierarchy_node()
+	{
+		return { (uint32_t)-1, (uint32_t)-1, (uint32_t)-1, (uint32_t)-1 };
+	}
+
+	// Removes the entity with [logical_index] from the children of its parent, if any.
+	static void unlink_from_parent(Entity_type& entity_type, uint32_t logical_index)
+	{
+		auto& hierarchy = entity_type.hierarchy;
+		auto& node = hierarchy[logical_index];
+		if (node.parent == (uint32_t)-1)
+			return;
+
+		if (node.prev_sibling != (uint32_t)-1)
+			hierarchy[node.prev_sibling].next_sibling = node.next_sibling;
 		else
+			hierarchy[node.parent].first_child = node.next_sibling;
+
+		if (node.next_sibling != (uint32_t)-1)
+			hierarchy[node.next_sibling].prev_sibling = node.prev_sibling;
+
+		node.parent = (uint32_t)-1;
+		node.next_sibling = (uint32_t)-1;
+		node.prev_sibling = (uint32_t)-1;
+	}
+
+	// Removes the destroyed entity with [logical_index] from the hierarchy of [entity_type],
+	// making its children roots.
+	static void remove_from_hierarchy(Entity_type& entity_type, uint32_t logical_index)
+	{
+		entity_type.hierarchy_dirty = true;
+		if (logical_index >= entity_type.hierarchy.size())
+			return;
+
+		auto& hierarchy = entity_type.hierarchy;
+		unlink_from_parent(entity_type, logical_index);
+
+		for (uint32_t child = hierarchy[logical_index].first_child; child != (uint32_t)-1;)
+		{
+			const uint32_t next_sibling = hierarchy[child].next_sibling;
+			hierarchy[child].parent = (uint32_t)-1;
+			hierarchy[child].next_sibling = (uint32_t)-1;
+			hierarchy[child].prev_sibling = (uint32_t)-1;
+			child = next_sibling;
+		}
+
+		hierarchy[logical_index] = no_hierarchy_node();
+	}
+
+	// Destroys all entities in [entities], which must be alive, distinct and sorted by type. For
+	// each entity type the component ranges are compacted in one pass per component: destroyed
+	// instances in the part of the range that remains alive are filled with the surviving
+	// instances at the back of the range.
+	static void destroy_sorted(Context& ctx, range<Entity*> entities)
+	{
+		Vector<uint32_t> physical_indices(ctx.m_allocator);
+
+		for (auto type_first = entities.begin(); type_first != entities.end();)
+		{
+			auto& entity_type = ctx.m_entity_types[type_first->type];
+
+			auto type_last = type_first;
+			while (type_last != entities.end() && type_last->type == type_first->type)
+				++type_last;
+
+			const uint32_t destroyed_count = (uint32_t)(type_last - type_first);
+			const uint32_t alive_count = entity_type.alive_count;
+
+			for (auto it = type_first; it != type_last; ++it)
+			{
+				assert(ctx.is_alive(*it));
+
+				// Increment generation count so that all entity ids like this one are now not alive.
+				++entity_type.generation[it->index];
+			}
+
+			entity_type.alive_count -= destroyed_count;
+			mark_entity_type_changed(ctx, entity_type);
+
+			for (auto& component_ref : get_component_refs(ctx, entity_type))
+			{
+				auto& component = ctx.m_components[component_ref.component_index];
+				auto& range = ctx.m_component_ranges[component_ref.component_range_global_index];
+
+				// Invalidate handles to the destroyed instances, even if no instance is moved.
+				++component.version;
+
+				physical_indices.clear();
+				for (auto it = type_first; it != type_last; ++it)
+					physical_indices.push_back(range.logical_to_physical[it->index]);
+
+				std::sort(physical_indices.begin(), physical_indices.end());
+
+				// Physical indices at or after [alive_end] are dropped from the range. Walk the
+				// holes before it and the survivors after it together.
+				const uint32_t alive_end = range.first_physical_index + entity_type.alive_count;
+				uint32_t back_index = range.first_physical_index + alive_count;
+				auto hole = physical_indices.begin();
+				auto dropped = physical_indices.end();
+
+				for (; hole != physical_indices.end() && *hole < alive_end; ++hole)
+				{
+					// Find the last surviving instance at the back of the range, skipping the
+					// destroyed ones.
+					--back_index;
+					while (dropped != hole && *(dropped - 1) == back_index)
+					{
+						--dropped;
+						--back_index;
+					}
+
+					move_instances(ctx, component, *hole, back_index, 1);
+
+					// Adjust the bookeeping physical to logical mapping.
+					uint32_t back_logical_index = component.physical_to_logical[back_index];
+					component.physical_to_logical[*hole] = back_logical_index;
+					range.logical_to_physical[back_logical_index] = *hole;
+				}
+			}
+
+			// The destroyed indices are not mapped anymore, they can be linked in the free list.
+			for (auto it = type_first; it != type_last; ++it)
+			{
+				remove_from_hierarchy(entity_type, it->index);
+				free_list_push(ctx, entity_type, it->index);
+			}
+
+			type_first = type_last;
+		}
+	}
+
+	// Computes the order in which entity types ranges are laid out in component arrays. Foreaches are
+	// visited from the heaviest to the lightest and the entity types they iterate over that have not
+	// been laid out yet are appended to the layout. This way the heaviest foreach iterates over
+	// adjacent ranges in all its components. The weight of a foreach is its profiled number of
+	// iterations if a profile has been set, otherwise its number of statements.
+	static Vector<Type> compute_entity_type_layout(Context const& ctx)
+	{
+		assert((ctx.m_foreach_profile.empty() || ctx.m_foreach_profile.size() == ctx.m_foreaches.size()) && "Foreach profile does not match defined foreaches.");
+
+		auto weight = [&](uint32_t foreach_index) -> uint64_t
+		{
+			return ctx.m_foreach_profile.empty() ? ctx.m_foreaches[foreach_index].foreach_stmt_count : ctx.m_foreach_profile[foreach_index];
+		};
+
+		Vector<uint32_t> foreach_order(ctx.m_foreaches.size(), 0, ctx.m_allocator);
+		for (uint32_t i = 0; i < foreach_order.size(); ++i)
+			foreach_order[i] = i;
+
+		std::stable_sort(foreach_order.begin(), foreach_order.end(), [&](uint32_t a, uint32_t b) { return weight(a) > weight(b); });
+
+		Vector<Type> layout(ctx.m_allocator);
+		Vector<bool> laid_out(ctx.m_entity_types.size(), false, ctx.m_allocator);
+
+		for (uint32_t foreach_index : foreach_order)
+		{
+			auto& foreach = ctx.m_foreaches[foreach_index];
+			for (uint32_t i = 0; i < foreach.foreach_stmt_count; ++i)
+			{
+				const Type entity_type_index = ctx.m_foreach_stmts[foreach.foreach_stmt_first + i].entity_type_index;
+				if (!laid_out[entity_type_index])
+				{
+					laid_out[entity_type_index] = true;
+					layout.push_back(entity_type_index);
+				}
+			}
+		}
+
+		// Finally, entity types no foreach iterates over.
+		for (uint32_t i = 0; i < ctx.m_entity_types.size(); ++i)
+			if (!laid_out[i])
+				layout.push_back((Type)i);
+
+		return layout;
+	}
+
+	// Returns an empty component range whose bookkeeping allocates with the context allocator.
+	static Component_range make_component_range(Context const& ctx)
+	{
+		Component_range component_range{};
+		component_range.logical_to_physical = Vector<uint32_t>(ctx.m_allocator);
+		return component_range;
+	}
+
+	// Computes the granularity of the range starts of [component], so that the first instance of
+	// each range is aligned to the range alignment.
+	static void compute_range_granularity(Context const& ctx, Component& component)
+	{
+		component.range_granularity = 1;
+		for (auto& field : get_component_fields(ctx, component))
+			while (ctx.m_range_alignment && component.range_granularity * field.size % ctx.m_range_alignment)
+				++component.range_granularity;
+	}
+
+	// Allocates the instance array of [component] with room for at least [capacity] instances.
+	static void allocate_array(Context const& ctx, Component& component, uint32_t capacity)
+	{
+		component.array_capacity = round_array_capacity(ctx, component, capacity);
+		component.array = (char*)ctx.m_allocator->allocate(component.array_capacity * component.instance_size, get_array_alignment(ctx, component));
+		component.physical_to_logical = (uint32_t*)ctx.m_allocator->allocate(component.array_capacity * sizeof(uint32_t), alignof(uint32_t));
+	}
+
+	// Builds the tables indexed by entity type and component: the component range lookup table
+	// and the entity type transition table.
+	static void build_lookup_tables(Context& ctx)
+	{
+		ctx.m_component_range_lookup.assign(ctx.m_entity_types.size() * ctx.m_components.size(), (uint32_t)-1);
+		for (auto& entity_type : ctx.m_entity_types)
+		{
+			const size_t row = (&entity_type - ctx.m_entity_types.data()) * ctx.m_components.size();
+			for (auto& component_ref : get_component_refs(ctx, entity_type))
+				ctx.m_component_range_lookup[row + component_ref.component_index] = component_ref.component_range_global_index;
+		}
+
+		// Link each pair of entity types that differ by one component both ways, from the entity
+		// type that has the component.
+		ctx.m_entity_type_transitions.assign(ctx.m_entity_types.size() * ctx.m_components.size(), (Type)-1);
+		Vector<uint64_t> component_ids(ctx.m_allocator);
+		for (uint32_t i = 0; i < ctx.m_entity_types.size(); ++i)
+			link_entity_type_transitions(ctx, (Type)i, false, component_ids);
+	}
+
+	// Adds the rows of the entity type at [entity_type_index], the last one, defined after setup,
+	// to the lookup tables. The tables are only rebuilt when components were defined along it,
+	// which changes their rows size.
+	static void add_to_lookup_tables(Context& ctx, Type entity_type_index)
+	{
+		assert(entity_type_index == ctx.m_entity_types.size() - 1);
+		const size_t components_count = ctx.m_components.size();
+
+		if (ctx.m_component_range_lookup.size() != entity_type_index * components_count)
+		{
+			build_lookup_tables(ctx);
+			return;
+		}
+
+		// The ranges of the new entity type shifted the ranges after them.
+		for (Type i = 0; i < entity_type_index; ++i)
+		{
+			for (auto& component_ref : get_component_refs(ctx, ctx.m_entity_types[i]))
+				ctx.m_component_range_lookup[i * components_count + component_ref.component_index] = component_ref.component_range_global_index;
+		}
+
+		ctx.m_component_range_lookup.resize(ctx.m_component_range_lookup.size() + components_count, (uint32_t)-1);
+		for (auto& component_ref : get_component_refs(ctx, ctx.m_entity_types[entity_type_index]))
+			ctx.m_component_range_lookup[entity_type_index * components_count + component_ref.component_index] = component_ref.component_range_global_index;
+
+		ctx.m_entity_type_transitions.resize(ctx.m_entity_type_transitions.size() + components_count, (Type)-1);
+		Vector<uint64_t> component_ids(ctx.m_allocator);
+		link_entity_type_transitions(ctx, entity_type_index, true, component_ids);
+	}
+
+	// Links the entity type at [entity_type_index] both ways to the entity types with the same
+	// shared components and the same components but one, looked up in `m_entity_type_indices`.
+	// Entity types with one more component are only looked up if [supersets], as linking every
+	// entity type to the ones with one less component links all pairs. [component_ids] is
+	// scratch memory.
+	static void link_entity_type_transitions(Context& ctx, Type entity_type_index, bool supersets, Vector<uint64_t>& component_ids)
+	{
+		auto& entity_type = ctx.m_entity_types[entity_type_index];
+		const size_t components_count = ctx.m_components.size();
+		auto component_refs = get_component_refs(ctx, entity_type);
+		auto shared_components = make_range(ctx.m_shared_components.data() + entity_type.shared_first, entity_type.shared_count);
+
+		auto link = [&](uint32_t component_index)
+		{
+			Entity_type* other = find_entity_type(ctx, make_range(component_ids.data(), component_ids.size()), shared_components);
+			if (!other)
+				return;
+
+			const Type other_index = (Type)(other - ctx.m_entity_types.data());
+			ctx.m_entity_type_transitions[entity_type_index * components_count + component_index] = other_index;
+			ctx.m_entity_type_transitions[other_index * components_count + component_index] = entity_type_index;
+		};
+
+		for (auto& removed_component_ref : component_refs)
+		{
+			component_ids.clear();
+			for (auto& component_ref : component_refs)
+				if (&component_ref != &removed_component_ref)
+					component_ids.push_back(component_ref.component_id);
+
+			link(removed_component_ref.component_index);
+		}
+
+		if (!supersets)
+			return;
+
+		for (uint32_t component_index = 0; component_index < components_count; ++component_index)
 		{
-			return component.array_capacity;
+			if (ctx.m_component_range_lookup[entity_type_index * components_count + component_index] != (uint32_t)-1)
+				continue;
+
+			// Component ids are kept sorted.
+			const uint64_t added_component_id = ctx.m_components[component_index].id;
+			component_ids.clear();
+			for (auto& component_ref : component_refs)
+				component_ids.push_back(component_ref.component_id);
+			component_ids.insert(std::lower_bound(component_ids.begin(), component_ids.end(), added_component_id), added_component_id);
+
+			link(component_index);
 		}
 	}
 
-	// Pushes an instance of specified component at the back of its range. After this function
-	// returns, an empty instance is at the end of specified component array. The size of the range
-	// is not effected and a reference to it is returned.
-	static void* component_push_back(Context& ctx, Component& component, uint32_t component_range_global_index)
-	{
-		auto& component_range = ctx.m_component_ranges[component_range_global_index];
+	// Returns whether [foreach] iterates over the entity type at [entity_type_index]. If so, the
+	// statement is written to [foreach_stmt] and the indices of its component refs are appended
+	// to `m_ids`.
+	static bool make_foreach_stmt(Context& ctx, uint32_t foreach_index, Type entity_type_index, Foreach_stmt& foreach_stmt)
+	{
+		auto& foreach = ctx.m_foreaches[foreach_index];
+		auto& entity_type = ctx.m_entity_types[entity_type_index];
+		const uint32_t component_ref_index_first = (uint32_t)ctx.m_ids.size();
+
+		for (uint32_t i = 0; i < foreach.component_id_count; ++i)
+		{
+			const uint64_t component_id = ctx.m_ids[foreach.component_id_first + i];
+
+			if ((foreach.shared_mask >> i) & 1)
+			{
+				uint32_t j = entity_type.shared_first;
+				while (j < entity_type.shared_first + entity_type.shared_count && ctx.m_shared_components[j].component_id != component_id)
+					++j;
+
+				if (j == entity_type.shared_first + entity_type.shared_count)
+				{
+					ctx.m_ids.resize(component_ref_index_first);
+					return false;
+				}
+
+				ctx.m_ids.push_back(j);
+				continue;
+			}
+
+			// Component refs are sorted by component id.
+			auto component_refs = get_component_refs(ctx, entity_type);
+			auto component_ref = std::lower_bound(component_refs.begin(), component_refs.end(), component_id, [](Component_ref const& ref, uint64_t id) { return ref.component_id < id; });
+			const uint32_t j = (uint32_t)(component_ref - component_refs.begin());
+
+			const bool found = component_ref != component_refs.end() && component_ref->component_id == component_id;
+			const bool excluded = (foreach.excluded_mask >> i) & 1;
+			const bool optional = (foreach.optional_mask >> i) & 1;
+
+			// Required component not found or excluded component found in entity type, undo any
+			// change made.
+			if (found == excluded && !optional)
+			{
+				ctx.m_ids.resize(component_ref_index_first);
+				return false;
+			}
+
+			ctx.m_ids.push_back(found && !excluded ? j : (uint64_t)-1);
+		}
+
+		foreach_stmt = { entity_type_index, component_ref_index_first, foreach.component_id_count };
+		return true;
+	}
+
+	// Adds the component ranges of the entity type at [entity_type_index], defined after setup.
+	// Each range is appended to the ranges of its component, after the instances of the current
+	// last range, and the statements of the foreaches that iterate over the entity type are
+	// appended to theirs. Component ranges and foreach statements following the inserted ones are
+	// shifted by one.
+	static void setup_entity_type(Context& ctx, Type entity_type_index)
+	{
+		// Set the components defined along the entity type up, they are the ones with no
+		// instance array yet, with no range.
+		for (auto& component : ctx.m_components)
+		{
+			if (component.array)
+				continue;
+
+			component.ranges_first = (uint32_t)ctx.m_component_ranges.size();
+			component.ranges_count = 0;
+			compute_range_granularity(ctx, component);
+			allocate_array(ctx, component, 0);
+		}
+
+		auto& entity_type = ctx.m_entity_types[entity_type_index];
+
+		for (auto& component_ref : get_component_refs(ctx, entity_type))
+		{
+			component_ref.component_index = (uint32_t)(ctx.find_component(component_ref.component_id) - ctx.m_components.data());
+
+			auto& component = ctx.m_components[component_ref.component_index];
+			const uint32_t component_range_global_index = component.ranges_first + component.ranges_count;
+
+			Component_range component_range = make_component_range(ctx);
+			component_range.entity_type_index = entity_type_index;
+#ifdef _DEBUG
+			component_range.component_index = component_ref.component_index;
+#endif
+
+			if (ctx.m_storage == Storage_slack)
+			{
+				component_range.first_physical_index = component.array_size;
+			}
+			else if (component.ranges_count)
+			{
+				// Start after the room of the last range, its reservation included, so that the
+				// last range can still grow up to its reservation without moving the new one.
+				auto& last_component_range = ctx.m_component_ranges[component_range_global_index - 1];
+				component_range.first_physical_index = last_component_range.first_physical_index + get_packed_range_capacity(ctx, component, last_component_range);
+				reserve_array(ctx, component, component_range.first_physical_index);
+			}
+
+			ctx.m_component_ranges.insert(ctx.m_component_ranges.begin() + component_range_global_index, std::move(component_range));
+			++component.ranges_count;
+
+			for (uint32_t i = component_ref.component_index + 1; i < ctx.m_components.size(); ++i)
+				++ctx.m_components[i].ranges_first;
+
+			// Component refs of the new entity type are resolved below.
+			for (uint32_t i = 0; i < entity_type.components_ref_first; ++i)
+				if (ctx.m_component_refs[i].component_range_global_index >= component_range_global_index)
+					++ctx.m_component_refs[i].component_range_global_index;
+		}
+
+		for (auto& component_ref : get_component_refs(ctx, entity_type))
+		{
+			auto& component = ctx.m_components[component_ref.component_index];
+			component_ref.component_range_global_index = component.ranges_first + component.ranges_count - 1;
+		}
+
+		// The new ranges are at the end of component arrays, so are the new statements in the
+		// foreaches they are walked forward by.
+		for (uint32_t foreach_index = 0; foreach_index < ctx.m_foreaches.size(); ++foreach_index)
+		{
+			Foreach_stmt foreach_stmt;
+			if (!make_foreach_stmt(ctx, foreach_index, entity_type_index, foreach_stmt))
+				continue;
+
+			auto& foreach = ctx.m_foreaches[foreach_index];
+			ctx.m_foreach_stmts.insert(ctx.m_foreach_stmts.begin() + foreach.foreach_stmt_first + foreach.foreach_stmt_count, foreach_stmt);
+			++foreach.foreach_stmt_count;
+
+			for (uint32_t i = foreach_index + 1; i < ctx.m_foreaches.size(); ++i)
+				++ctx.m_foreaches[i].foreach_stmt_first;
+		}
+
+		add_to_lookup_tables(ctx, entity_type_index);
+
+		// The new entity type may make systems conflict.
+		ctx.m_system_order.clear();
+	}
+
+	// Returns whether the systems [a] and [b] conflict, that is whether their foreaches iterate
+	// over an entity type in common and access one of its components, at least one of them with
+	// write access.
+	static bool systems_conflict(Context const& ctx, System const& a, System const& b)
+	{
+		auto& foreach_a = ctx.m_foreaches[a.foreach_index];
+		auto& foreach_b = ctx.m_foreaches[b.foreach_index];
+
+		for (auto& foreach_stmt_a : make_range(ctx.m_foreach_stmts.data() + foreach_a.foreach_stmt_first, foreach_a.foreach_stmt_count))
+		{
+			for (auto& foreach_stmt_b : make_range(ctx.m_foreach_stmts.data() + foreach_b.foreach_stmt_first, foreach_b.foreach_stmt_count))
+			{
+				if (foreach_stmt_a.entity_type_index != foreach_stmt_b.entity_type_index)
+					continue;
+
+				// Statements of the same entity type refer to components by the same local
+				// component ref indices, -1 for the ones not accessed.
+				for (uint32_t i = 0; i < foreach_a.component_id_count; ++i)
+				{
+					const uint64_t component_ref_index = ctx.m_ids[foreach_stmt_a.component_ref_index_first + i];
+					if (component_ref_index == (uint64_t)-1)
+						continue;
+
+					for (uint32_t j = 0; j < foreach_b.component_id_count; ++j)
+					{
+						const bool read_only = ((foreach_a.read_only_mask >> i) & 1) && ((foreach_b.read_only_mask >> j) & 1);
+						const bool same_kind = ((foreach_a.shared_mask >> i) & 1) == ((foreach_b.shared_mask >> j) & 1);
+						if (ctx.m_ids[foreach_stmt_b.component_ref_index_first + j] == component_ref_index && same_kind && !read_only)
+							return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+	// Orders the systems in passes: each system runs in the pass following the last pass of the
+	// systems registered before it that it conflicts with.
+	static void schedule_systems(Context& ctx)
+	{
+		Vector<uint32_t> system_passes(ctx.m_systems.size(), 0, ctx.m_allocator);
+		uint32_t pass_count = 0;
+
+		for (uint32_t i = 0; i < ctx.m_systems.size(); ++i)
+		{
+			for (uint32_t j = 0; j < i; ++j)
+				if (system_passes[j] + 1 > system_passes[i] && systems_conflict(ctx, ctx.m_systems[j], ctx.m_systems[i]))
+					system_passes[i] = system_passes[j] + 1;
+
+			pass_count = std::max(pass_count, system_passes[i] + 1);
+		}
+
+		ctx.m_system_order.clear();
+		ctx.m_system_pass_ends.clear();
+
+		for (uint32_t pass = 0; pass < pass_count; ++pass)
+		{
+			for (uint32_t i = 0; i < ctx.m_systems.size(); ++i)
+				if (system_passes[i] == pass)
+					ctx.m_system_order.push_back(i);
+
+			ctx.m_system_pass_ends.push_back((uint32_t)ctx.m_system_order.size());
+		}
+	}
+
+	// Returns the FNV-1a hash of the [count] 64 bit [values], continuing [hash].
+	static uint64_t hash_values(uint64_t const* values, size_t count, uint64_t hash = 14695981039346656037ULL)
+	{
+		for (size_t i = 0; i < count; ++i)
+			for (uint32_t j = 0; j < 8; ++j)
+				hash = (hash ^ ((values[i] >> (j * 8)) & 0xff)) * 1099511628211ULL;
+		return hash;
+	}
+
+	// Returns the hash `m_entity_type_indices` indexes the entity type with the sorted
+	// [component_ids] and [shared_components] by. Shared instances are left out, they can be
+	// modified through `get_shared()`.
+	static uint64_t hash_entity_type(range<uint64_t*> component_ids, range<Shared_component*> shared_components)
+	{
+		uint64_t hash = hash_values(component_ids.begin(), component_ids.size());
+		for (auto& shared_component : shared_components)
+			hash = hash_values(&shared_component.component_id, 1, hash);
+		return hash;
+	}
+
+	// Returns the entity type with the sorted [component_ids] and [shared_components], or null if
+	// there is none.
+	static Entity_type* find_entity_type(Context& ctx, range<uint64_t*> component_ids, range<Shared_component*> shared_components)
+	{
+		for (auto candidates = ctx.m_entity_type_indices.equal_range(hash_entity_type(component_ids, shared_components)); candidates.first != candidates.second; ++candidates.first)
+		{
+			auto& entity_type = ctx.m_entity_types[candidates.first->second];
+			if (component_ids.size() != entity_type.components_count || shared_components.size() != entity_type.shared_count)
+				continue;
+
+			auto components_ref_range = get_component_refs(ctx, entity_type);
+			if (!std::equal(component_ids.begin(), component_ids.end(), components_ref_range.begin(), [](uint64_t id, Component_ref const& ref) { return id == ref.component_id; }))
+				continue;
+
+			if (std::equal(shared_components.begin(), shared_components.end(), ctx.m_shared_components.begin() + entity_type.shared_first, [](Shared_component const& a, Shared_component const& b)
+				{ return a.component_id == b.component_id && a.size == b.size && !memcmp(a.instance, b.instance, a.size); }))
+				return &entity_type;
+		}
+		return nullptr;
+	}
+
+	// Adds the entity type at [entity_type_index] to the bitsets of the entity types having each of
+	// its components, growing the bitsets rows as needed.
+	static void add_to_component_entity_types(Context& ctx, Type entity_type_index)
+	{
+		auto& sets = ctx.m_component_entity_types;
+		uint32_t& words = ctx.m_component_entity_types_words;
+
+		if (entity_type_index / 64U >= words)
+		{
+			const uint32_t new_words = std::max(words * 2, entity_type_index / 64U + 1);
+			Vector<uint64_t> new_sets(ctx.m_components.size() * new_words, 0, ctx.m_allocator);
+			for (size_t row = 0; words && row < sets.size() / words; ++row)
+				std::copy(sets.begin() + row * words, sets.begin() + (row + 1) * words, new_sets.begin() + row * new_words);
+
+			sets = std::move(new_sets);
+			words = new_words;
+		}
+
+		sets.resize(ctx.m_components.size() * words, 0);
+		for (auto& component_ref : get_component_refs(ctx, ctx.m_entity_types[entity_type_index]))
+		{
+			const size_t component_index = ctx.find_component(component_ref.component_id) - ctx.m_components.data();
+			sets[component_index * words + entity_type_index / 64] |= 1ULL << (entity_type_index % 64);
+		}
+	}
+
+	static bool entity_less(Entity const& a, Entity const& b)
+	{
+		return a.type < b.type || (a.type == b.type && a.index < b.index);
+	}
+
+	static bool entity_equal(Entity const& a, Entity const& b)
+	{
+		return a.type == b.type && a.index == b.index && a.generation == b.generation;
+	}
+
+	static range<Component_ref*> get_component_refs(Context& ctx, Entity_type const& etype)
+	{
+		auto begin = ctx.m_component_refs.data() + etype.components_ref_first;
+		return{ begin, begin + etype.components_count };
+	}
+
+	// Snapshot images start with a header, followed by a record per component, a record per
+	// entity type followed by its generations and shared component instances, and a record per
+	// component range followed by its
+	// logical to physical mapping and, unless the range is left out of a delta, the physical to
+	// logical mapping and field arrays of its live instances. Component ranges are ordered by
+	// component.
+	static const uint32_t image_magic = 0x53434e45;
+
+	// Files written by `save()` share the records of snapshot images, but the records of
+	// components are followed by an `Image_arrays` record and ranges records are not followed by
+	// their instances: the component arrays are stored whole at the end of the file, each aligned
+	// as in memory so that they can be used in place.
+	static const uint32_t mapped_image_magic = 0x4d434e45;
+
+	struct Image_header
+	{
+		uint64_t schema_hash;
+		uint64_t base_version;
+		uint64_t change_version;
+		uint32_t magic;
+		uint32_t component_count;
+		uint32_t entity_type_count;
+		uint32_t component_range_count;
+		uint32_t storage;
+		uint32_t range_alignment;
+	};
+
+	struct Image_component
+	{
+		uint32_t instance_size;
+		uint32_t fields_count;
+		uint32_t ranges_count;
+		uint32_t array_capacity;
+		uint32_t array_size;
+	};
+
+	struct Image_entity_type
+	{
+		uint32_t components_count;
+		uint32_t alive_count;
+		uint32_t reserved_count;
+		uint32_t recycle_first;
+		uint32_t free_first;
+		uint32_t free_last;
+		uint32_t free_count;
+		uint32_t generation_count;
+		uint32_t hierarchy_count;
+	};
+
+	struct Image_range
+	{
+		uint64_t change_version;
+		uint32_t entity_type_index;
+		uint32_t first_physical_index;
+		uint32_t capacity;
+		uint32_t included;
+	};
+
+	struct Image_arrays
+	{
+		uint64_t array_offset;
+		uint64_t physical_to_logical_offset;
+	};
+
+	// A component range record of an image being restored, with the location of its arrays.
+	struct Image_range_ref
+	{
+		Image_range range;
+		char const* logical_to_physical;
+		char const* instances;
+	};
+
+	// Returns a hash of the definitions of the context which the layout of images depends on.
+	static uint64_t compute_schema_hash(Context const& ctx)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		auto combine = [&](uint32_t value)
+		{
+			for (uint32_t i = 0; i < 4; ++i)
+				hash = (hash ^ ((value >> (i * 8)) & 0xff)) * 1099511628211ULL;
+		};
+
+		// The split of entity ids sets the size of the generations and entities images hold.
+		combine(ENTITY_TYPE_BITS);
+		combine(ENTITY_GENERATION_BITS);
+
+		combine((uint32_t)ctx.m_components.size());
+		for (auto& component : ctx.m_components)
+		{
+			combine((uint32_t)component.id);
+			combine((uint32_t)(component.id >> 32));
+			combine(component.instance_size);
+			combine(component.alignment);
+			combine(component.fields_count);
+			for (auto& field : get_component_fields(ctx, component))
+			{
+				combine(field.size);
+				combine(field.offset);
+			}
+		}
+
+		combine((uint32_t)ctx.m_entity_types.size());
+		for (auto& entity_type : ctx.m_entity_types)
+		{
+			combine(entity_type.components_count);
+			for (uint32_t i = 0; i < entity_type.components_count; ++i)
+				combine(ctx.m_component_refs[entity_type.components_ref_first + i].component_index);
+
+			combine(entity_type.shared_count);
+			for (uint32_t i = entity_type.shared_first; i < entity_type.shared_first + entity_type.shared_count; ++i)
+			{
+				combine((uint32_t)ctx.m_shared_components[i].component_id);
+				combine((uint32_t)(ctx.m_shared_components[i].component_id >> 32));
+				combine(ctx.m_shared_components[i].size);
+			}
+		}
+
+		combine((uint32_t)ctx.m_storage);
+		combine(ctx.m_range_alignment);
+		return hash;
+	}
+
+	static void write_image(std::vector<char>& image, void const* data, size_t size)
+	{
+		image.insert(image.end(), (char const*)data, (char const*)data + size);
+	}
+
+	// Reads an image sequentially, checking reads stay within bounds.
+	struct Image_reader
+	{
+		char const* it;
+		char const* end;
+
+		// Returns the location of the next [size] bytes and skips them, or null if the image is
+		// too short.
+		char const* skip(size_t size)
+		{
+			if ((size_t)(end - it) < size)
+				return nullptr;
+			it += size;
+			return it - size;
+		}
+
+		template <typename T>
+		bool read(T& value)
+		{
+			char const* data = skip(sizeof(T));
+			if (data)
+				memcpy(&value, data, sizeof(T));
+			return data != nullptr;
+		}
+	};
+
+	// The records of an image being restored, checked against the context definitions.
+	struct Image
+	{
+		Image(Allocator* allocator)
+			: components(allocator)
+			, arrays(allocator)
+			, entity_types(allocator)
+			, generations(allocator)
+			, hierarchies(allocator)
+			, shared_instances(allocator)
+			, component_ranges(allocator)
+		{
+		}
+
+		Image_header header;
+		Vector<Image_component> components;
+		Vector<Image_arrays> arrays;
+		Vector<Image_entity_type> entity_types;
+		Vector<char const*> generations;
+		Vector<char const*> hierarchies;
+		Vector<char const*> shared_instances;
+		Vector<Image_range_ref> component_ranges;
+	};
+
+	// Writes the records of an image of [ctx] with the specified [magic] to [image]. Snapshot
+	// images include after each range record the instances of the ranges changed since
+	// [since_version], mapped images have zeroed `Image_arrays` records to fill instead.
+	static void write_image_records(Context const& ctx, std::vector<char>& image, uint32_t magic, uint64_t since_version)
+	{
+		const bool mapped = magic == mapped_image_magic;
+
+		const Image_header header = { compute_schema_hash(ctx), since_version, ctx.m_change_version, magic, (uint32_t)ctx.m_components.size(),
+			(uint32_t)ctx.m_entity_types.size(), (uint32_t)ctx.m_component_ranges.size(), (uint32_t)ctx.m_storage, ctx.m_range_alignment };
+		write_image(image, &header, sizeof(header));
+
+		for (auto& component : ctx.m_components)
+		{
+			const Image_component record = { component.instance_size, component.fields_count, component.ranges_count, component.array_capacity, component.array_size };
+			write_image(image, &record, sizeof(record));
+
+			if (mapped)
+			{
+				const Image_arrays arrays = {};
+				write_image(image, &arrays, sizeof(arrays));
+			}
+		}
+
+		for (auto& entity_type : ctx.m_entity_types)
+		{
+			const Image_entity_type record = { entity_type.components_count, entity_type.alive_count, entity_type.reserved_count, entity_type.recycle_first,
+				entity_type.free_first, entity_type.free_last, entity_type.free_count, (uint32_t)entity_type.generation.size(), (uint32_t)entity_type.hierarchy.size() };
+			write_image(image, &record, sizeof(record));
+			write_image(image, entity_type.generation.data(), entity_type.generation.size() * sizeof(Generation));
+			write_image(image, entity_type.hierarchy.data(), entity_type.hierarchy.size() * sizeof(Hierarchy_node));
+
+			for (uint32_t i = entity_type.shared_first; i < entity_type.shared_first + entity_type.shared_count; ++i)
+				write_image(image, ctx.m_shared_components[i].instance, ctx.m_shared_components[i].size);
+		}
+
+		for (auto& component : ctx.m_components)
+		{
+			for (uint32_t i = component.ranges_first; i < component.ranges_first + component.ranges_count; ++i)
+			{
+				auto& component_range = ctx.m_component_ranges[i];
+				const uint32_t alive_count = ctx.m_entity_types[component_range.entity_type_index].alive_count;
+				const bool included = !mapped && (!since_version || component_range.change_version > since_version);
+
+				const Image_range record = { component_range.change_version, component_range.entity_type_index, component_range.first_physical_index, component_range.capacity, included };
+				write_image(image, &record, sizeof(record));
+				write_image(image, component_range.logical_to_physical.data(), component_range.logical_to_physical.size() * sizeof(uint32_t));
+
+				if (!included)
+					continue;
+
+				write_image(image, component.physical_to_logical + component_range.first_physical_index, alive_count * sizeof(uint32_t));
+				for (auto& field : get_component_fields(ctx, component))
+					write_image(image, component.array + (size_t)component.array_capacity * field.offset + (size_t)component_range.first_physical_index * field.size, (size_t)alive_count * field.size);
+			}
+		}
+	}
+
+	// Reads the records of an image with the specified [magic] from [reader] into [image].
+	// Returns false if the image is truncated or does not match the definitions of [ctx].
+	static bool read_image_records(Context const& ctx, Image_reader& reader, uint32_t magic, Image& image)
+	{
+		const bool mapped = magic == mapped_image_magic;
+
+		auto& header = image.header;
+		if (!reader.read(header) || header.magic != magic || header.schema_hash != compute_schema_hash(ctx) || header.component_count != ctx.m_components.size() ||
+			header.entity_type_count != ctx.m_entity_types.size() || header.component_range_count != ctx.m_component_ranges.size() ||
+			header.storage != (uint32_t)ctx.m_storage || header.range_alignment != ctx.m_range_alignment)
+			return false;
+
+		image.components.resize(ctx.m_components.size());
+		image.arrays.resize(mapped ? ctx.m_components.size() : 0);
+		for (uint32_t i = 0; i < ctx.m_components.size(); ++i)
+		{
+			auto& record = image.components[i];
+			auto& component = ctx.m_components[i];
+			if (!reader.read(record) || record.instance_size != component.instance_size || record.fields_count != component.fields_count ||
+				record.ranges_count != component.ranges_count || record.array_size > record.array_capacity)
+				return false;
+
+			if (mapped && !reader.read(image.arrays[i]))
+				return false;
+		}
+
+		image.entity_types.resize(ctx.m_entity_types.size());
+		image.generations.resize(ctx.m_entity_types.size());
+		image.hierarchies.resize(ctx.m_entity_types.size());
+		image.shared_instances.resize(ctx.m_entity_types.size());
+		for (uint32_t i = 0; i < ctx.m_entity_types.size(); ++i)
+		{
+			auto& record = image.entity_types[i];
+			if (!reader.read(record) || record.components_count != ctx.m_entity_types[i].components_count ||
+				record.alive_count > record.generation_count || record.recycle_first > record.generation_count ||
+				record.hierarchy_count > record.generation_count)
+				return false;
+
+			image.generations[i] = reader.skip(record.generation_count * sizeof(Generation));
+			image.hierarchies[i] = reader.skip(record.hierarchy_count * sizeof(Hierarchy_node));
+			if (!image.generations[i] || !image.hierarchies[i])
+				return false;
+
+			auto& entity_type = ctx.m_entity_types[i];
+			size_t shared_size = 0;
+			for (uint32_t j = entity_type.shared_first; j < entity_type.shared_first + entity_type.shared_count; ++j)
+				shared_size += ctx.m_shared_components[j].size;
+
+			image.shared_instances[i] = reader.skip(shared_size);
+			if (!image.shared_instances[i])
+				return false;
+		}
+
+		image.component_ranges.resize(ctx.m_component_ranges.size());
+		for (uint32_t c = 0; c < ctx.m_components.size(); ++c)
+		{
+			auto& component = ctx.m_components[c];
+
+			size_t instance_size = sizeof(uint32_t);
+			for (auto& field : get_component_fields(ctx, component))
+				instance_size += field.size;
+
+			for (uint32_t i = component.ranges_first; i < component.ranges_first + component.ranges_count; ++i)
+			{
+				auto& ref = image.component_ranges[i];
+				if (!reader.read(ref.range) || ref.range.entity_type_index != ctx.m_component_ranges[i].entity_type_index)
+					return false;
+
+				auto& entity_type = image.entity_types[ref.range.entity_type_index];
+				if ((uint64_t)ref.range.first_physical_index + entity_type.alive_count > image.components[c].array_capacity)
+					return false;
+
+				ref.logical_to_physical = reader.skip(entity_type.generation_count * sizeof(uint32_t));
+				if (!ref.logical_to_physical)
+					return false;
+
+				// A range left out of a delta must be unchanged since the base image.
+				if (!ref.range.included)
+				{
+					if (!mapped && (!header.base_version || ctx.m_entity_types[ref.range.entity_type_index].alive_count != entity_type.alive_count))
+						return false;
+					ref.instances = nullptr;
+					continue;
+				}
+
+				ref.instances = reader.skip(entity_type.alive_count * instance_size);
+				if (!ref.instances || mapped)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Sets the state of [ctx] but its component arrays from the records of [image].
+	static void apply_image_records(Context& ctx, Image const& image)
+	{
+		for (uint32_t i = 0; i < ctx.m_component_ranges.size(); ++i)
+		{
+			auto& ref = image.component_ranges[i];
+			auto& component_range = ctx.m_component_ranges[i];
+			component_range.first_physical_index = ref.range.first_physical_index;
+			component_range.capacity = ref.range.capacity;
+			component_range.change_version = ref.range.change_version;
+			component_range.logical_to_physical.resize(image.entity_types[ref.range.entity_type_index].generation_count);
+			if (!component_range.logical_to_physical.empty())
+				memcpy(component_range.logical_to_physical.data(), ref.logical_to_physical, component_range.logical_to_physical.size() * sizeof(uint32_t));
+		}
+
+		for (uint32_t i = 0; i < ctx.m_entity_types.size(); ++i)
+		{
+			auto& entity_type = ctx.m_entity_types[i];
+			auto& record = image.entity_types[i];
+			entity_type.alive_count = record.alive_count;
+			entity_type.reserved_count = record.reserved_count;
+			entity_type.recycle_first = record.recycle_first;
+			entity_type.free_first = record.free_first;
+			entity_type.free_last = record.free_last;
+			entity_type.free_count = record.free_count;
+			entity_type.generation.resize(record.generation_count);
+			if (!entity_type.generation.empty())
+				memcpy(entity_type.generation.data(), image.generations[i], record.generation_count * sizeof(Generation));
+
+			entity_type.hierarchy.resize(record.hierarchy_count);
+			if (!entity_type.hierarchy.empty())
+				memcpy(entity_type.hierarchy.data(), image.hierarchies[i], record.hierarchy_count * sizeof(Hierarchy_node));
+			entity_type.hierarchy_dirty = true;
+
+			char const* shared_instance = image.shared_instances[i];
+			for (uint32_t j = entity_type.shared_first; j < entity_type.shared_first + entity_type.shared_count; ++j)
+			{
+				memcpy(ctx.m_shared_components[j].instance, shared_instance, ctx.m_shared_components[j].size);
+				shared_instance += ctx.m_shared_components[j].size;
+			}
+		}
+
+		ctx.m_destroy_queue.clear();
+		ctx.m_change_version = image.header.change_version;
+	}
+
+	// Blobs written by `extract_entities()` start with a header, followed per entity type by a
+	// record, a record per component, a record per shared component followed by its instance,
+	// the extracted entity ids sorted by index, the position in the entity type of the parent of
+	// each entity, and the field arrays of the instances of each component.
+	static const uint32_t blob_magic = 0x42434e45;
+
+	struct Blob_header
+	{
+		uint32_t magic;
+		uint32_t entity_type_count;
+		uint32_t entity_count;
+	};
+
+	struct Blob_entity_type
+	{
+		uint32_t components_count;
+		uint32_t shared_count;
+		uint32_t entity_count;
+	};
+
+	struct Blob_component
+	{
+		uint64_t component_id;
+		uint64_t layout_hash;
+	};
+
+	struct Blob_shared_component
+	{
+		uint64_t component_id;
+		uint32_t size;
+		uint32_t alignment;
+	};
+
+	// An entity type record of a blob being inserted, with the location of its arrays.
+	struct Blob_entity_type_ref
+	{
+		Type type;
+		uint32_t entity_count;
+		char const* entities;
+		char const* parents;
+		char const* instances;
+	};
+
+	// Returns a hash of the layout of the instances of [component], which blobs depend on.
+	static uint64_t compute_layout_hash(Context const& ctx, Component const& component)
+	{
+		const uint64_t values[] = { component.id, component.instance_size, component.alignment, component.fields_count };
+		uint64_t hash = hash_values(values, 4);
+		for (auto& field : get_component_fields(ctx, component))
+		{
+			const uint64_t field_values[] = { field.size, field.offset };
+			hash = hash_values(field_values, 2, hash);
+		}
+		return hash;
+	}
+};
+
+Context::Context(Allocator& allocator)
+	: m_allocator(&allocator)
+	, m_ids(m_allocator)
+	, m_component_indices(m_allocator)
+	, m_entity_type_indices(m_allocator)
+	, m_foreach_indices(m_allocator)
+	, m_shared_components(m_allocator)
+	, m_component_entity_types(m_allocator)
+	, m_components(m_allocator)
+	, m_component_index_lookup(m_allocator)
+	, m_component_range_lookup(m_allocator)
+	, m_entity_type_transitions(m_allocator)
+	, m_component_fields(m_allocator)
+	, m_component_ranges(m_allocator)
+	, m_entity_types(m_allocator)
+	, m_component_refs(m_allocator)
+	, m_foreaches(m_allocator)
+	, m_foreach_stmts(m_allocator)
+	, m_foreach_profile(m_allocator)
+	, m_destroy_queue(m_allocator)
+	, m_systems(m_allocator)
+	, m_system_order(m_allocator)
+	, m_system_pass_ends(m_allocator)
+	, m_command_buffers(m_allocator)
+{
+}
+
+Context::~Context()
+{
+	for (auto& component : m_components)
+		Private::free_array(*this, component);
+
+	for (auto& shared_component : m_shared_components)
+		m_allocator->deallocate(shared_component.instance, shared_component.size, shared_component.alignment);
+
+	for (auto& system : m_systems)
+		system.destroy(*m_allocator, system.fn);
+}
+
+void Context::setup(Storage storage, uint32_t range_alignment)
+{
+	assert((range_alignment & (range_alignment - 1)) == 0 && "Range alignment must be a power of two.");
+
+	m_storage = storage;
+	m_range_alignment = range_alignment;
+
+
+	// Temporary array that holds the number of ranges pushed per component (index).
+	Vector<uint32_t> component_range_end(m_components.size(), 0U, m_allocator);
+
+	for (auto& component : m_components)
+	{
+		// Reserve required ranges from the array and resolve the 'first' index.
+		component.ranges_first = m_component_ranges.size();
+		m_component_ranges.resize(m_component_ranges.size() + component.ranges_count, Private::make_component_range(*this));
+
+		Private::compute_range_granularity(*this, component);
+	}
+
+	// Lay the entity types out in an order that keeps the entity types iterated by the same
+	// foreach adjacent in each component array.
+	const Vector<Type> layout = Private::compute_entity_type_layout(*this);
+
+	for (Type entity_type_index : layout)
+	{
+		auto& entity_type = m_entity_types[entity_type_index];
+
+		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+		{
+			// Resolve component index from component id.
+			component_ref.component_index = find_component(component_ref.component_id) - m_components.data();
+
+			// Setup the appropriate component range with this entity type index.
+			component_ref.component_range_global_index = m_components[component_ref.component_index].ranges_first + component_range_end[component_ref.component_index]++;
+
+			// Set range entity type index to this entity type index.
+			m_component_ranges[component_ref.component_range_global_index].entity_type_index = entity_type_index;
+
+#ifdef _DEBUG
+			m_component_ranges[component_ref.component_range_global_index].component_index = component_ref.component_index;
+#endif
+		}
+	}
+
+	// Place the ranges of each component one after the other, each with room for the entities
+	// reserved for its type, and allocate the component instances memory all at once.
+	for (auto& component : m_components)
+	{
+		uint32_t array_size = 0;
+		for (uint32_t i = 0; i < component.ranges_count; ++i)
+		{
+			auto& component_range = m_component_ranges[component.ranges_first + i];
+			component_range.first_physical_index = array_size;
+			component_range.capacity = Private::get_packed_range_capacity(*this, component, component_range);
+			array_size += component_range.capacity;
+		}
+
+		component.array_size = array_size;
+		Private::allocate_array(*this, component, array_size);
+	}
+
+	for (auto& entity_type : m_entity_types)
+		Private::reserve_entity_type(*this, entity_type, entity_type.reserved_count);
+
+	// Sort the statements of each foreach in layout order, so that foreaches walk component arrays
+	// forward.
+	Vector<uint32_t> layout_position(m_entity_types.size(), 0, m_allocator);
+	for (uint32_t i = 0; i < layout.size(); ++i)
+		layout_position[layout[i]] = i;
+
+	for (auto& foreach : m_foreaches)
+	{
+		auto foreach_stmts = make_range(m_foreach_stmts.data() + foreach.foreach_stmt_first, foreach.foreach_stmt_count);
+		std::sort(foreach_stmts.begin(), foreach_stmts.end(), [&](Foreach_stmt const& a, Foreach_stmt const& b)
+		{
+			return layout_position[a.entity_type_index] < layout_position[b.entity_type_index];
+		});
+	}
+
+	Private::build_lookup_tables(*this);
+}
+
+Entity Context::create(Type type_id)
+{
+	Entity entity;
+	create_n(type_id, 1, &entity);
+	return entity;
+}
+
+void Context::create_n(Type type_id, uint32_t count, Entity* entities)
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	auto& entity_type = m_entity_types[type_id];
+
+	if (!count)
+		return;
+
+	// Generate new local indices for the new entities, reusing free indices first, then the ones
+	// freed by the last `clear()`.
+	uint32_t reused_count = std::min(count, entity_type.free_count);
+
+	for (uint32_t i = 0; i < reused_count; ++i)
+	{
+		uint32_t logical_index = Private::free_list_pop(*this, entity_type);
+		entities[i] = Entity{ type_id, entity_type.generation[logical_index], logical_index };
+	}
+
+	const uint32_t recycled_count = std::min(count - reused_count, (uint32_t)entity_type.generation.size() - entity_type.recycle_first);
+
+	for (uint32_t i = 0; i < recycled_count; ++i)
+	{
+		uint32_t logical_index = entity_type.recycle_first++;
+		entities[reused_count++] = Entity{ type_id, ++entity_type.generation[logical_index], logical_index };
+	}
+
+	// No more reusable indices. Create the remaining logical indices all at once, they will be
+	// mapped to component indices below.
+	if (reused_count < count)
+	{
+		const uint32_t logical_index_first = (uint32_t)entity_type.generation.size();
+		const uint32_t logical_index_count = count - reused_count;
+
+		// Indices must fit in ENTITY_INDEX_BITS bits, the largest 32 bit index is the end of free list
+		// marker.
+		assert((uint64_t)logical_index_first + logical_index_count < ((uint64_t)1 << ENTITY_INDEX_BITS) && "Too many entities for ENTITY_INDEX_BITS.");
+
+		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+		{
+			m_component_ranges[component_ref.component_range_global_index].logical_to_physical.resize(logical_index_first + logical_index_count);
+		}
+		entity_type.generation.resize(logical_index_first + logical_index_count, 0);
+		entity_type.recycle_first = logical_index_first + logical_index_count;
+
+		for (uint32_t i = 0; i < logical_index_count; ++i)
+		{
+			entities[reused_count + i] = Entity{ type_id, 0, logical_index_first + i };
+		}
+	}
+
+	for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+	{
+		auto& component = m_components[component_ref.component_index];
+		auto& range = m_component_ranges[component_ref.component_range_global_index];
+
+		const uint32_t physical_index_first = Private::component_push_back(*this, component, component_ref.component_range_global_index, count);
+
+		// Invoke component type default constructor on all new instances.
+		component.construct(component.array, component.array_capacity, physical_index_first, count);
+
+		// Update bookkeeping so that both the physical index of each new component and the entity
+		// logical index within this component range map to each other.
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			range.logical_to_physical[entities[i].index] = physical_index_first + i;
+			component.physical_to_logical[physical_index_first + i] = entities[i].index;
+		}
+	}
+
+	entity_type.alive_count += count;
+	entity_type.hierarchy_dirty = true;
+	Private::mark_entity_type_changed(*this, entity_type);
+}
+
+void Context::destroy(Entity entity)
+{
+	// Entity destruction involves two steps: moving the last instance of each entity component range
+	// into delete component location reducing by one the range of components and updating the
+	// mapping between entity indices and component indices to affect this change. By adding a level
+	// of indirection between entity index and component index we effectively make deletion not
+	// terribly expensive as we don't need to update all existing entities but only one.
+
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	assert(is_alive(entity));
+	auto& entity_type = m_entity_types[entity.type];
+
+	// Increment generation count so that all entity ids like `entity` are now not alive.
+	++entity_type.generation[entity.index];
+
+	--entity_type.alive_count;
+	Private::mark_entity_type_changed(*this, entity_type);
+
+	// Move the last entity in the range in the position of the deleted component.
+	for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+	{
+		auto& component = m_components[component_ref.component_index];
+		auto& range = m_component_ranges[component_ref.component_range_global_index];
+
+		const uint32_t destroyed_physical_index = range.logical_to_physical[entity.index];
+		const uint32_t back_physical_index = range.first_physical_index + entity_type.alive_count;
+
+		Private::move_instances(*this, component, destroyed_physical_index, back_physical_index, 1);
+
+		// Adjust the bookeeping physical to logical mapping.
+		uint32_t back_logical_index = component.physical_to_logical[back_physical_index];
+		component.physical_to_logical[destroyed_physical_index] = back_logical_index;
+		range.logical_to_physical[back_logical_index] = destroyed_physical_index;
+	}
+
+	Private::remove_from_hierarchy(entity_type, entity.index);
+	Private::free_list_push(*this, entity_type, entity.index);
+}
+
+void Context::destroy_n(Entity const* entities, uint32_t count)
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	Vector<Entity> sorted_entities(entities, entities + count, m_allocator);
+	std::sort(sorted_entities.begin(), sorted_entities.end(), Private::entity_less);
+	assert(std::adjacent_find(sorted_entities.begin(), sorted_entities.end(), Private::entity_equal) == sorted_entities.end() && "Entities destroyed more than once.");
+
+	Private::destroy_sorted(*this, make_range(sorted_entities.data(), sorted_entities.size()));
+}
+
+void Context::migrate(Entity& entity, uint32_t component_type_index, bool add)
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	assert(is_alive(entity));
+	assert(component_type_index < m_component_index_lookup.size() && m_component_index_lookup[component_type_index] != (uint32_t)-1 && "Undefined component.");
+
+	const size_t transition_index = entity.type * m_components.size() + m_component_index_lookup[component_type_index];
+	assert((m_component_range_lookup[transition_index] == (uint32_t)-1) == add && "Component already added or not present.");
+	(void)add;
+
+	const Type target_type = m_entity_type_transitions[transition_index];
+	assert(target_type != (Type)-1 && "Migration to an undefined entity type.");
+
+	Entity migrated;
+	create_n(target_type, 1, &migrated);
+
+	// Move the instances of the components both entity types have over the default constructed
+	// ones.
+	for (auto& component_ref : Private::get_component_refs(*this, m_entity_types[target_type]))
+	{
+		const uint32_t component_range_global_index = m_component_range_lookup[entity.type * m_components.size() + component_ref.component_index];
+		if (component_range_global_index == (uint32_t)-1)
+			continue;
+
+		const uint32_t src_index = m_component_ranges[component_range_global_index].logical_to_physical[entity.index];
+		const uint32_t dest_index = m_component_ranges[component_ref.component_range_global_index].logical_to_physical[migrated.index];
+		Private::move_instances(*this, m_components[component_ref.component_index], dest_index, src_index, 1);
+	}
+
+	destroy(entity);
+	entity = migrated;
+}
+
+void Context::destroy_deferred(Entity entity)
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	m_destroy_queue.push_back(entity);
+}
+
+void Context::flush()
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	// Drop entities that have been destroyed in the meantime, sort the others by type and drop
+	// duplicates. Stale ids must go first: the sort only compares types and indices, so a stale id
+	// could end up between two copies of the live id reusing its index.
+	m_destroy_queue.erase(std::remove_if(m_destroy_queue.begin(), m_destroy_queue.end(), [this](Entity entity) { return !is_alive(entity); }), m_destroy_queue.end());
+	std::sort(m_destroy_queue.begin(), m_destroy_queue.end(), Private::entity_less);
+	m_destroy_queue.erase(std::unique(m_destroy_queue.begin(), m_destroy_queue.end(), Private::entity_equal), m_destroy_queue.end());
+
+	Private::destroy_sorted(*this, make_range(m_destroy_queue.data(), m_destroy_queue.size()));
+
+	m_destroy_queue.clear();
+}
+
+void Context::clear()
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	// Invalidate all component handles.
+	for (auto& component : m_components)
+		++component.version;
+
+	// Reset all entity lists.
+	for (auto& entity_type : m_entity_types)
+	{
+#ifdef _DEBUG
+		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+		{
+			auto& range = m_component_ranges[component_ref.component_range_global_index];
+			assert(range.logical_to_physical.size() == entity_type.generation.size());
+		}
+#endif
+
+		entity_type.alive_count = 0;
+
+		// Make all entity indices free, their generation is bumped lazily as they are reused.
+		entity_type.recycle_first = 0;
+		entity_type.free_first = (uint32_t)-1;
+		entity_type.free_last = (uint32_t)-1;
+		entity_type.free_count = 0;
+
+		entity_type.hierarchy.clear();
+		entity_type.hierarchy_dirty = true;
+
+		// The emptied ranges must be part of delta snapshots.
+		Private::mark_entity_type_changed(*this, entity_type);
+	}
+}
+
+void Context::reserve(Type type, uint32_t count)
+{
+	assert(type < m_entity_types.size());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	auto& entity_type = m_entity_types[type];
+
+	entity_type.reserved_count = count;
+
+	if (is_setup())
+		Private::reserve_entity_type(*this, entity_type, count);
+}
+
+void Context::shrink_to_fit()
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	for (auto& component : m_components)
+		Private::shrink_array(*this, component);
+
+	m_destroy_queue.shrink_to_fit();
+}
+
+void Context::reorder(Type type, uint32_t const* order)
+{
+	auto& entity_type = m_entity_types[type];
+
+	// Only move the span of instances that are out of place.
+	uint32_t first = 0;
+	uint32_t last = entity_type.alive_count;
+	while (first < last && order[first] == first)
+		++first;
+	while (last > first && order[last - 1] == last - 1)
+		--last;
+
+	if (first == last)
+		return;
+
+	Vector<char> scratch(m_allocator);
+	Vector<uint32_t> physical_to_logical(m_allocator);
+	for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+	{
+		auto& component = m_components[component_ref.component_index];
+		auto& component_range = m_component_ranges[component_ref.component_range_global_index];
+		const uint32_t first_physical_index = component_range.first_physical_index + first;
+
+		++component.version;
+
+		for (auto& field : Private::get_component_fields(*this, component))
+		{
+			char* field_array = component.array + (size_t)component.array_capacity * field.offset;
+			scratch.resize((size_t)(last - first) * field.size);
+			for (uint32_t i = first; i < last; ++i)
+				memcpy(scratch.data() + (size_t)(i - first) * field.size, field_array + (size_t)(component_range.first_physical_index + order[i]) * field.size, field.size);
+			memcpy(field_array + (size_t)first_physical_index * field.size, scratch.data(), scratch.size());
+		}
+
+		physical_to_logical.resize(last - first);
+		for (uint32_t i = first; i < last; ++i)
+			physical_to_logical[i - first] = component.physical_to_logical[component_range.first_physical_index + order[i]];
+		memcpy(component.physical_to_logical + first_physical_index, physical_to_logical.data(), (last - first) * sizeof(uint32_t));
+		ENTITY_COUNT(*this, copied_bytes, (uint64_t)(last - first) * (component.instance_size + sizeof(uint32_t)));
+
+		// Update logical to physical index mapping of moved instances.
+		for (uint32_t i = first_physical_index; i < first_physical_index + last - first; ++i)
+			component_range.logical_to_physical[component.physical_to_logical[i]] = i;
+	}
+
+	Private::mark_entity_type_changed(*this, entity_type);
+}
+
+void Context::order_hierarchy(Type type)
+{
+	auto& entity_type = m_entity_types[type];
+	if (!entity_type.hierarchy_dirty || !entity_type.components_count)
+		return;
+
+	auto& hierarchy = entity_type.hierarchy;
+	auto& first_ref = m_component_refs[entity_type.components_ref_first];
+	auto& component = m_components[first_ref.component_index];
+	auto& component_range = m_component_ranges[first_ref.component_range_global_index];
+	const uint32_t count = entity_type.alive_count;
+
+	// Visit the trees depth first, from the roots in their current order.
+	if (!hierarchy.empty())
+	{
+		Vector<uint32_t> order(m_allocator);
+		Vector<uint32_t> stack(m_allocator);
+		order.reserve(count);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const uint32_t logical_index = component.physical_to_logical[component_range.first_physical_index + i];
+			if (logical_index < hierarchy.size() && hierarchy[logical_index].parent != (uint32_t)-1)
+				continue;
+
+			stack.push_back(logical_index);
+			while (!stack.empty())
+			{
+				const uint32_t node_index = stack.back();
+				stack.pop_back();
+				order.push_back(component_range.logical_to_physical[node_index] - component_range.first_physical_index);
+
+				if (node_index < hierarchy.size())
+				{
+					for (uint32_t child = hierarchy[node_index].first_child; child != (uint32_t)-1; child = hierarchy[child].next_sibling)
+						stack.push_back(child);
+				}
+			}
+		}
+
+		assert(order.size() == count);
+		reorder(type, order.data());
+	}
+
+	entity_type.parent_positions.resize(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const uint32_t logical_index = component.physical_to_logical[component_range.first_physical_index + i];
+		const uint32_t parent = logical_index < hierarchy.size() ? hierarchy[logical_index].parent : (uint32_t)-1;
+		entity_type.parent_positions[i] = parent != (uint32_t)-1 ? component_range.logical_to_physical[parent] - component_range.first_physical_index : (uint32_t)-1;
+	}
+
+	entity_type.hierarchy_dirty = false;
+}
+
+void Context::set_parent(Entity child, Entity parent)
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+	assert(is_alive(child));
+	auto& entity_type = m_entity_types[child.type];
+	auto& hierarchy = entity_type.hierarchy;
+
+	const bool detach = parent.is_null();
+	if (detach && child.index >= hierarchy.size())
+		return;
+
+	assert((detach || is_alive(parent)) && "Parent is not alive.");
+	assert((detach || parent.type == child.type) && "Parent and child must be of the same entity type.");
+
+	hierarchy.resize(entity_type.generation.size(), Private::no_hierarchy_node());
+
+#ifdef _DEBUG
+	if (!detach)
+	{
+		for (uint32_t ancestor = parent.index; ancestor != (uint32_t)-1; ancestor = hierarchy[ancestor].parent)
+			assert(ancestor != child.index && "Parenting an entity to itself or one of its descendants.");
+	}
+#endif
+
+	Private::unlink_from_parent(entity_type, child.index);
+	entity_type.hierarchy_dirty = true;
+
+	if (detach)
+		return;
+
+	auto& node = hierarchy[child.index];
+	auto& parent_node = hierarchy[parent.index];
+	node.parent = parent.index;
+	node.next_sibling = parent_node.first_child;
+	if (node.next_sibling != (uint32_t)-1)
+		hierarchy[node.next_sibling].prev_sibling = child.index;
+	parent_node.first_child = child.index;
+}
+
+Entity Context::get_parent(Entity entity) const
+{
+	assert(is_alive(entity));
+	auto& entity_type = m_entity_types[entity.type];
+	if (entity.index >= entity_type.hierarchy.size() || entity_type.hierarchy[entity.index].parent == (uint32_t)-1)
+		return Entity();
+
+	const uint32_t parent = entity_type.hierarchy[entity.index].parent;
+	return Entity{ (Type)entity.type, entity_type.generation[parent], parent };
+}
+
+bool Context::is_alive(Entity entity) const
+{
+	assert(is_setup());
+	return	entity.type < m_entity_types.size() &&
+			entity.index < m_entity_types[entity.type].recycle_first &&
+			(m_entity_types[entity.type].generation[entity.index] & (((uint64_t)1 << ENTITY_GENERATION_BITS) - 1)) == entity.generation;
+}
+
+void Context::set_foreach_profile(std::vector<uint64_t> profile)
+{
+	assert(!is_setup());
+	m_foreach_profile.assign(profile.begin(), profile.end());
+}
+
+std::vector<uint64_t> Context::foreach_profile() const
+{
+	std::vector<uint64_t> profile;
+	for (auto& foreach : m_foreaches)
+		profile.push_back(foreach.iteration_count);
+	return profile;
+}
+
+std::vector<uint64_t> Context::foreach_times() const
+{
+	std::vector<uint64_t> times;
+	for (auto& foreach : m_foreaches)
+		times.push_back(foreach.time);
+	return times;
+}
+
+void Context::reset_counters()
+{
+	m_counters = {};
+	for (auto& foreach : m_foreaches)
+		foreach.time = 0;
+}
+
+Job_system& Context::job_system()
+{
+	if (m_job_system)
+		return *m_job_system;
+
+	if (!m_default_job_system)
+		m_default_job_system.reset(new Thread_pool());
+
+	return *m_default_job_system;
+}
+
+void Context::run_systems()
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Parallel passes cannot be nested.");
+
+	if (m_system_order.size() != m_systems.size())
+		Private::schedule_systems(*this);
+
+	struct Job
+	{
+		Context* context;
+		Foreach_batch const* batches;
+		uint32_t const* batch_systems;
+	};
+
+	Vector<Foreach_batch> batches(m_allocator);
+	Vector<uint32_t> batch_systems(m_allocator);
+
+	uint32_t pass_first = 0;
+	for (uint32_t pass_end : m_system_pass_ends)
+	{
+		batches.clear();
+		batch_systems.clear();
+
+		for (uint32_t i = pass_first; i < pass_end; ++i)
+		{
+			build_foreach_batches(m_systems[m_system_order[i]].foreach_index, batches);
+			batch_systems.resize(batches.size(), m_system_order[i]);
+		}
+
+		pass_first = pass_end;
+
+		Job job{ this, batches.data(), batch_systems.data() };
+
+		begin_parallel_pass();
+
+		job_system().run((uint32_t)batches.size(), [](void* data, uint32_t job_index, uint32_t worker_index)
+		{
+			auto& job = *static_cast<Job*>(data);
+			current_worker_index() = worker_index;
+			auto& system = job.context->m_systems[job.batch_systems[job_index]];
+			system.run_batch(*job.context, system.fn, job.batches[job_index]);
+		}, &job);
+
+		end_parallel_pass();
+	}
+}
+
+void Context::begin_parallel_pass()
+{
+	assert(!m_parallel_pass && "Parallel passes cannot be nested.");
+
+	const uint32_t worker_count = std::max(job_system().worker_count(), 1U);
+	while (m_command_buffers.size() < worker_count)
+		m_command_buffers.push_back(Command_buffer(*m_allocator));
+
+	m_parallel_pass = true;
+}
+
+void Context::end_parallel_pass()
+{
+	m_parallel_pass = false;
+	current_worker_index() = 0;
+}
+
+Command_buffer& Context::command_buffer()
+{
+	if (m_command_buffers.empty())
+	{
+		assert(!m_parallel_pass);
+		m_command_buffers.push_back(Command_buffer(*m_allocator));
+	}
+
+	return m_command_buffers[m_parallel_pass ? current_worker_index() : 0];
+}
+
+void Context::playback()
+{
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	// Create the entities of all command buffers, grouped by entity type so that each component
+	// range grows once.
+	struct Create
+	{
+		Type type;
+		uint32_t command_buffer_index;
+		uint32_t created_index;
+	};
+
+	Vector<Create> creates(m_allocator);
+	for (uint32_t i = 0; i < m_command_buffers.size(); ++i)
+	{
+		auto& command_buffer = m_command_buffers[i];
+		command_buffer.m_created.resize(command_buffer.m_creates.size());
+		for (uint32_t j = 0; j < command_buffer.m_creates.size(); ++j)
+			creates.push_back({ command_buffer.m_creates[j], i, j });
+	}
+
+	std::stable_sort(creates.begin(), creates.end(), [](Create const& a, Create const& b) { return a.type < b.type; });
+
+	Vector<Entity> entities(m_allocator);
+	for (auto first = creates.begin(); first != creates.end();)
+	{
+		auto last = first;
+		while (last != creates.end() && last->type == first->type)
+			++last;
+
+		entities.resize(last - first);
+		create_n(first->type, (uint32_t)entities.size(), entities.data());
+
+		for (auto it = first; it != last; ++it)
+			m_command_buffers[it->command_buffer_index].m_created[it->created_index] = entities[it - first];
+
+		first = last;
+	}
+
+	// Apply the component writes and queue the destructions.
+	for (auto& command_buffer : m_command_buffers)
+	{
+		for (auto& command : command_buffer.m_commands)
+		{
+			const Entity entity = command.created_index != (uint32_t)-1 ? command_buffer.m_created[command.created_index] : command.entity;
+			if (!is_alive(entity))
+				continue;
+
+			if (command.kind == Command_buffer::Command_destroy)
+			{
+				m_destroy_queue.push_back(entity);
+				continue;
+			}
+
+			auto location = get_component_instance(entity, command.component_type_index);
+			assert(location.component && "Writing a component the entity does not have.");
+
+			auto& component = *location.component;
+			m_component_ranges[location.component_range_global_index].change_version = ++m_change_version;
 
-		uint32_t back_index = component_range.first_physical_index + ctx.m_entity_types[component_range.entity_type_index].alive_count;
+			// Scatter the fields of the instance, for components stored as structure of arrays.
+			char const* instance = command_buffer.m_data.data() + command.data_offset;
+			for (auto& field : Private::get_component_fields(*this, component))
+				memcpy(component.array + (size_t)component.array_capacity * field.offset + (size_t)location.physical_index * field.size, instance + field.offset, field.size);
+		}
 
-		if (component_range_global_index + 1 < component.ranges_first + component.ranges_count)
-		{
-			// This range is followed by another range. See if the next range starts at least one
-			// instance away from this range last, which means we can insert our new instance without
-			// moving memory around.
-			auto& next_component_range = ctx.m_component_ranges[component_range_global_index + 1];
+		command_buffer.m_creates.clear();
+		command_buffer.m_commands.clear();
+		command_buffer.m_data.clear();
+		command_buffer.m_created.clear();
+	}
 
-			// If there's no space at the end of this range for one more instance...
-			if (back_index >= next_component_range.first_physical_index)
-			{
-				assert(back_index == next_component_range.first_physical_index);
+	flush();
+}
 
-				// Make room for one more at the end of next range.
-				component_push_back(ctx, component, component_range_global_index + 1);
+void Context::build_foreach_batches(uint32_t foreach_index, Vector<Foreach_batch>& batches)
+{
+	// Batches are a multiple of 64 instances, which makes each batch start at a cache line
+	// boundary relative to the start of its range whatever the component size. Aim for a few
+	// batches per worker for load balancing.
+	const uint32_t batch_granularity = 64;
 
-				uint32_t next_component_back_index = next_component_range.first_physical_index + ctx.m_entity_types[next_component_range.entity_type_index].alive_count;
+	auto& foreach = m_foreaches[foreach_index];
 
-				char* dest_ptr = component.array + next_component_back_index * component.instance_size;
-				char* back_ptr = component.array + back_index * component.instance_size;
+	uint32_t total_count = 0;
+	for (uint32_t i = 0; i < foreach.foreach_stmt_count; ++i)
+		total_count += m_entity_types[m_foreach_stmts[foreach.foreach_stmt_first + i].entity_type_index].alive_count;
 
-				// Move first element to the newly inserted element.
-				memcpy(dest_ptr, back_ptr, component.instance_size);
+	foreach.iteration_count += total_count;
 
-				// Update logical to physical index mapping.
-				if (ctx.m_entity_types[next_component_range.entity_type_index].alive_count)
-				{
-					uint32_t logical_index = component.physical_to_logical[back_index];
-					next_component_range.logical_to_physical[logical_index] = next_component_back_index;
-					component.physical_to_logical[next_component_back_index] = logical_index;
-				}
+	// Stamp the ranges here as batches are run concurrently.
+	++m_change_version;
+	for (uint32_t i = 0; i < foreach.foreach_stmt_count; ++i)
+		mark_changed(foreach, m_foreach_stmts[foreach.foreach_stmt_first + i]);
 
-				// Shift the next range up by one.
-				++next_component_range.first_physical_index;
-			}
-		}
-		else
-		{
-			// This is the last component range. We shall operate on the instances array itself.
-			if (back_index >= component.array_capacity)
-			{
-				// Not enough space. Grow the instance array.
-				component.array_capacity *= 2;
-				component.array = (char*)realloc(component.array, component.array_capacity * component.instance_size);
-				component.physical_to_logical = (uint32_t*)realloc(component.physical_to_logical, component.array_capacity * sizeof(uint32_t));
-			}
-		}
+	const uint32_t target_batch_count = job_system().worker_count() * 4;
+	uint32_t batch_size = (total_count + target_batch_count - 1) / target_batch_count;
+	batch_size = std::max((batch_size + batch_granularity - 1) / batch_granularity * batch_granularity, batch_granularity);
 
-		// Clear the new component instance memory.
-		return component.array + back_index * component.instance_size;
+	for (uint32_t i = 0; i < foreach.foreach_stmt_count; ++i)
+	{
+		const uint32_t foreach_stmt_index = foreach.foreach_stmt_first + i;
+		const uint32_t alive_count = m_entity_types[m_foreach_stmts[foreach_stmt_index].entity_type_index].alive_count;
+
+		for (uint32_t first = 0; first < alive_count; first += batch_size)
+			batches.push_back({ foreach_stmt_index, first, std::min(first + batch_size, alive_count) });
 	}
+}
 
-	static range<Component_ref*> get_component_refs(Context& ctx, Entity_type const& etype)
+void Context::mark_changed(Foreach const& foreach, Foreach_stmt const& foreach_stmt)
+{
+	auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
+
+	for (uint32_t i = 0; i < foreach.component_id_count; ++i)
 	{
-		auto begin = ctx.m_component_refs.data() + etype.components_ref_first;
-		return{ begin, begin + etype.components_count };
+		const uint64_t component_ref_index = m_ids[foreach_stmt.component_ref_index_first + i];
+		if (component_ref_index != (uint64_t)-1 && !(((foreach.read_only_mask | foreach.shared_mask) >> i) & 1))
+			m_component_ranges[m_component_refs[entity_type.components_ref_first + component_ref_index].component_range_global_index].change_version = m_change_version;
 	}
-};
+}
 
-Context::~Context()
+bool Context::is_changed_since(Foreach const& foreach, Foreach_stmt const& foreach_stmt, uint64_t version) const
 {
-	for (auto& component : m_components)
+	auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
+
+	for (uint32_t i = 0; i < foreach.component_id_count; ++i)
 	{
-		free(component.array);
-		free(component.physical_to_logical);
+		const uint64_t component_ref_index = m_ids[foreach_stmt.component_ref_index_first + i];
+		if (component_ref_index != (uint64_t)-1 && !((foreach.shared_mask >> i) & 1) && m_component_ranges[m_component_refs[entity_type.components_ref_first + component_ref_index].component_range_global_index].change_version > version)
+			return true;
 	}
+
+	return false;
 }
 
-void Context::setup()
+char* Context::find_shared_instance(Type type, uint64_t component_id)
 {
-	// Temporary array that holds the number of ranges pushed per component (index).
-	std::vector<uint32_t> component_range_end;
-	component_range_end.resize(m_components.size(), 0U);
+	auto& entity_type = m_entity_types[type];
+	for (uint32_t i = entity_type.shared_first; i < entity_type.shared_first + entity_type.shared_count; ++i)
+		if (m_shared_components[i].component_id == component_id)
+			return m_shared_components[i].instance;
+	return nullptr;
+}
 
-	for (auto& component : m_components)
+Context::Component const* Context::find_component(uint64_t component_id) const
+{
+	auto it = m_component_indices.find(component_id);
+	return it != m_component_indices.end() ? &m_components[it->second] : nullptr;
+}
+
+Context::Entity_type* Context::find_create_entity_type(range<uint64_t*> component_ids, range<Shared_component*> shared_components)
+{
+	assert(component_ids.size() && "Entity types must have at least one component.");
+
+	// Sort the component ids to simplify search.
+	std::sort(component_ids.begin(), component_ids.end());
+	std::sort(shared_components.begin(), shared_components.end(), [](Shared_component const& a, Shared_component const& b) { return a.component_id < b.component_id; });
+
+	// See if there's a previously defined entity type matching specified components. If so, just
+	// return that, no need to create the same entity type twice.
+	if (Entity_type* entity_type = Private::find_entity_type(*this, component_ids, shared_components))
+		return entity_type;
+
+	// Entity type not found, create one.
+	auto components_ref_first = m_component_refs.size();
+		
+	for (auto component_id : component_ids)
 	{
-		// Reserve required ranges from the array and resolve the 'first' index.
-		component.ranges_first = m_component_ranges.size();
-		m_component_ranges.resize(m_component_ranges.size() + component.ranges_count);
+		m_component_refs.push_back({ component_id, 0, 0 });
 
-		// Allocate initial component instances memory.
-		component.array_capacity = 16;
-		component.array = (char*)malloc(component.array_capacity * component.instance_size);
-		component.physical_to_logical = (uint32_t*)malloc(component.array_capacity * sizeof(*component.physical_to_logical));
+		// After setup, ranges are added by `setup_entity_type()`.
+		if (!is_setup())
+			++find_component(component_id)->ranges_count;
 	}
 
-	// #todo optimization: sort entity types by the number of components they have, and sort
-	// components by frequency (maybe?).
-
-	for (auto& entity_type : m_entity_types)
+	assert(m_entity_types.size() < ((size_t)1 << ENTITY_TYPE_BITS) - 1 && "Too many entity types for ENTITY_TYPE_BITS.");
+
+	Entity_type entity_type = {};
+	entity_type.components_ref_first = (uint32_t)components_ref_first;
+	entity_type.components_count = (uint32_t)(m_component_refs.size() - components_ref_first);
+	entity_type.generation = Vector<Generation>(m_allocator);
+	entity_type.hierarchy = Vector<Hierarchy_node>(m_allocator);
+	entity_type.parent_positions = Vector<uint32_t>(m_allocator);
+	entity_type.free_first = (uint32_t)-1;
+	entity_type.free_last = (uint32_t)-1;
+
+	// Copy the shared component instances.
+	entity_type.shared_first = (uint32_t)m_shared_components.size();
+	entity_type.shared_count = (uint32_t)shared_components.size();
+	for (auto shared_component : shared_components)
 	{
-		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
-		{
-			// Resolve component index from component id.
-			component_ref.component_index = find_component(component_ref.component_id) - m_components.data();
+		assert(!std::binary_search(component_ids.begin(), component_ids.end(), shared_component.component_id) && "A component cannot be both shared and per entity.");
 
-			// Setup the appropriate component range with this entity type index.
-			component_ref.component_range_global_index = m_components[component_ref.component_index].ranges_first + component_range_end[component_ref.component_index]++;
+		char* instance = (char*)m_allocator->allocate(shared_component.size, shared_component.alignment);
+		memcpy(instance, shared_component.instance, shared_component.size);
+		shared_component.instance = instance;
+		m_shared_components.push_back(shared_component);
+	}
 
-			// Set range entity type index to this entity type index.
-			m_component_ranges[component_ref.component_range_global_index].entity_type_index = (uint16_t)(&entity_type - m_entity_types.data());
+	m_entity_types.push_back(std::move(entity_type));
 
-#ifdef _DEBUG
-			m_component_ranges[component_ref.component_range_global_index].component_index = component_ref.component_index;
-#endif
-		}
+	const Type entity_type_index = (Type)(m_entity_types.size() - 1);
+	m_entity_type_indices.emplace(Private::hash_entity_type(component_ids, shared_components), entity_type_index);
+	Private::add_to_component_entity_types(*this, entity_type_index);
+
+	if (is_setup())
+	{
+		assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+		Private::setup_entity_type(*this, entity_type_index);
 	}
+
+	return &m_entity_types.back();
 }
 
-Entity Context::create(Type type_id)
+uint32_t Context::define_foreach(std::initializer_list<uint64_t> component_ids, std::initializer_list<Match> matches, std::initializer_list<bool> read_only)
 {
-	assert(is_setup());
-	auto& entity_type = m_entity_types[type_id];
+	const uint32_t num_components = component_ids.size();
+	assert(num_components <= 32 && "Foreach component lists are limited to 32 components.");
 
-	// Generate a new local index for the new entity.
-	uint32_t logical_index;
+	uint32_t optional_mask = 0;
+	uint32_t excluded_mask = 0;
+	uint32_t read_only_mask = 0;
+	uint32_t shared_mask = 0;
+	for (uint32_t i = 0; i < num_components; ++i)
+	{
+		optional_mask |= (matches.begin()[i] == Match_optional) << i;
+		excluded_mask |= (matches.begin()[i] == Match_excluded) << i;
+		shared_mask |= (matches.begin()[i] == Match_shared) << i;
+		read_only_mask |= read_only.begin()[i] << i;
+	}
 
-	// Try reusing some free index.
-	if (!entity_type.free_indices.empty())
+	// See if we have already defined this combination of components.
+	const uint64_t masks[2] = { (uint64_t)optional_mask | (uint64_t)excluded_mask << 32, (uint64_t)read_only_mask | (uint64_t)shared_mask << 32 };
+	const uint64_t hash = Private::hash_values(masks, 2, Private::hash_values(component_ids.begin(), num_components));
+	for (auto candidates = m_foreach_indices.equal_range(hash); candidates.first != candidates.second; ++candidates.first)
 	{
-		logical_index = entity_type.free_indices.front();
-		entity_type.free_indices.pop_front();
+		auto& foreach = m_foreaches[candidates.first->second];
+		if (num_components == foreach.component_id_count && optional_mask == foreach.optional_mask && excluded_mask == foreach.excluded_mask && read_only_mask == foreach.read_only_mask && shared_mask == foreach.shared_mask &&
+			std::equal(component_ids.begin(), component_ids.end(), m_ids.begin() + foreach.component_id_first))
+			return candidates.first->second;
 	}
-	else
+
+	// No matching foreach found, create a new one.
+	m_foreaches.push_back({ (uint32_t)m_ids.size(), num_components, (uint32_t)m_foreach_stmts.size(), 0, 0, 0, optional_mask, excluded_mask, read_only_mask, shared_mask });
+
+	const uint32_t foreach_index = (uint32_t)m_foreaches.size() - 1;
+	m_foreach_indices.emplace(hash, foreach_index);
+
+	// Insert covered component ids into the array of ids.
+	m_ids.insert(m_ids.end(), component_ids.begin(), component_ids.end());
+
+	// Find the entity types matching this foreach component list: the ones that have all the
+	// required components and none of the excluded ones. Shared components are matched by
+	// `make_foreach_stmt()`.
+	const uint32_t words = m_component_entity_types_words;
+	Vector<uint64_t> matching(words, ~0ULL, m_allocator);
+	for (uint32_t i = 0; i < num_components; ++i)
 	{
-		// No reusable indices. Create a new logical index and map it to the component index.
-		logical_index = entity_type.alive_count;
-		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+		if (((optional_mask | shared_mask) >> i) & 1)
+			continue;
+
+		const bool excluded = (excluded_mask >> i) & 1;
+		auto component = find_component(component_ids.begin()[i]);
+		if (!component)
 		{
-			m_component_ranges[component_ref.component_range_global_index].logical_to_physical.emplace_back();
+			if (!excluded)
+				std::fill(matching.begin(), matching.end(), 0);
+			continue;
 		}
-		entity_type.generation.push_back(0);
+
+		auto entity_types = m_component_entity_types.data() + (component - m_components.data()) * words;
+		for (uint32_t j = 0; j < words; ++j)
+			matching[j] &= excluded ? ~entity_types[j] : entity_types[j];
 	}
 
-	for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+	for (uint32_t entity_type_index = 0; entity_type_index < m_entity_types.size(); ++entity_type_index)
 	{
-		auto& component = m_components[component_ref.component_index];
-		auto& range = m_component_ranges[component_ref.component_range_global_index];
-
-		void* ptr = Private::component_push_back(*this, component, component_ref.component_range_global_index);
+		if ((matching[entity_type_index / 64] >> (entity_type_index % 64)) & 1)
+		{
+			Foreach_stmt foreach_stmt;
+			if (Private::make_foreach_stmt(*this, foreach_index, (Type)entity_type_index, foreach_stmt))
+				m_foreach_stmts.push_back(foreach_stmt);
+		}
+	}
 
-		// Invoke component type default constructor.
-		component.construct(ptr);
+	// After setup, walk the component arrays forward: sort the statements by the range of their
+	// first required component, as `setup()` does by layout order.
+	uint32_t first_required = 0;
+	while (first_required < num_components && ((optional_mask | excluded_mask | shared_mask) >> first_required & 1))
+		++first_required;
 
-		// Update bookkeeping so that both the physical index of this component index and the entity
-		// logical index within this component range map to each other.
-		uint32_t physical_index = range.first_physical_index + entity_type.alive_count;
-		range.logical_to_physical[logical_index] = physical_index;
-		component.physical_to_logical[physical_index] = logical_index;
+	if (is_setup() && first_required < num_components)
+	{
+		auto foreach_stmts = make_range(m_foreach_stmts.data() + m_foreaches.back().foreach_stmt_first, m_foreach_stmts.size() - m_foreaches.back().foreach_stmt_first);
+		auto first_component_range = [&](Foreach_stmt const& foreach_stmt)
+		{
+			return m_component_refs[m_entity_types[foreach_stmt.entity_type_index].components_ref_first + m_ids[foreach_stmt.component_ref_index_first + first_required]].component_range_global_index;
+		};
+		std::sort(foreach_stmts.begin(), foreach_stmts.end(), [&](Foreach_stmt const& a, Foreach_stmt const& b) { return first_component_range(a) < first_component_range(b); });
 	}
+	
+	m_foreaches.back().foreach_stmt_count = m_foreach_stmts.size() - m_foreaches.back().foreach_stmt_first;
 
-	++entity_type.alive_count;
-
-	return Entity{ (uint16_t)type_id, entity_type.generation[logical_index], logical_index };
+	return m_foreaches.size() - 1;
 }
 
-void Context::destroy(Entity entity)
+void Context::snapshot(std::vector<char>& image, uint64_t since_version) const
 {
-	// Entity destruction involves two steps: moving the last instance of each entity component range
-	// into delete component location reducing by one the range of components and updating the
-	// mapping between entity indices and component indices to affect this change. By adding a level
-	// of indirection between entity index and component index we effectively make deletion not
-	// terribly expensive as we don't need to update all existing entities but only one.
+	assert(is_setup());
+	assert(!m_parallel_pass && "Snapshots cannot be taken during parallel passes.");
+
+	image.clear();
+	Private::write_image_records(*this, image, Private::image_magic, since_version);
+}
 
+bool Context::restore(void const* image, size_t size)
+{
 	assert(is_setup());
-	assert(is_alive(entity));
-	auto& entity_type = m_entity_types[entity.type];
-	
-	entity_type.free_indices.push_back(entity.index);
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
 
-	// Increment generation count so that all entity ids like `entity` are now not alive.
-	++entity_type.generation[entity.index];
+	// Parse and check the whole image before modifying anything.
+	Private::Image_reader reader = { (char const*)image, (char const*)image + size };
+	Private::Image records(m_allocator);
+	if (!Private::read_image_records(*this, reader, Private::image_magic, records) || reader.it != reader.end)
+		return false;
 
-	--entity_type.alive_count;
+	if (records.header.base_version && records.header.base_version != m_change_version)
+		return false;
 
-	// Move the last entity in the range in the position of the deleted component.
-	for (auto& component_ref : Private::get_component_refs(*this, entity_type))
+	// Rebuild the component arrays, taking the instances of ranges left out of a delta from the
+	// current arrays.
+	for (uint32_t c = 0; c < m_components.size(); ++c)
 	{
-		auto& component = m_components[component_ref.component_index];
-		auto& range = m_component_ranges[component_ref.component_range_global_index];
+		auto& component = m_components[c];
+		auto& record = records.components[c];
 
-		const uint32_t destroyed_physical_index = range.logical_to_physical[entity.index];
-		const uint32_t back_physical_index = range.first_physical_index + entity_type.alive_count;
+		char* array = (char*)m_allocator->allocate((size_t)record.array_capacity * component.instance_size, Private::get_array_alignment(*this, component));
+		uint32_t* physical_to_logical = (uint32_t*)m_allocator->allocate(record.array_capacity * sizeof(uint32_t), alignof(uint32_t));
 
-		char* destroyed_instance_ptr = component.array + destroyed_physical_index * component.instance_size;
-		char* back_instance_ptr = component.array + back_physical_index * component.instance_size;
+		for (uint32_t i = component.ranges_first; i < component.ranges_first + component.ranges_count; ++i)
+		{
+			auto& ref = records.component_ranges[i];
+			auto& component_range = m_component_ranges[i];
+			const uint32_t count = records.entity_types[ref.range.entity_type_index].alive_count;
+			const uint32_t first = ref.range.first_physical_index;
 
-		memcpy(destroyed_instance_ptr, back_instance_ptr, component.instance_size);
+			char const* instances = ref.instances;
+			if (instances)
+			{
+				memcpy(physical_to_logical + first, instances, count * sizeof(uint32_t));
+				instances += count * sizeof(uint32_t);
+			}
+			else
+				memcpy(physical_to_logical + first, component.physical_to_logical + component_range.first_physical_index, count * sizeof(uint32_t));
 
-		// Adjust the bookeeping physical to logical mapping.
-		uint32_t back_logical_index = component.physical_to_logical[back_physical_index];
-		component.physical_to_logical[destroyed_physical_index] = back_logical_index;
-		range.logical_to_physical[back_logical_index] = destroyed_physical_index;
+			for (auto& field : Private::get_component_fields(*this, component))
+			{
+				char* dest = array + (size_t)record.array_capacity * field.offset + (size_t)first * field.size;
+				if (instances)
+				{
+					memcpy(dest, instances, (size_t)count * field.size);
+					instances += (size_t)count * field.size;
+				}
+				else
+					memcpy(dest, component.array + (size_t)component.array_capacity * field.offset + (size_t)component_range.first_physical_index * field.size, (size_t)count * field.size);
+			}
+		}
+
+		Private::free_array(*this, component);
+
+		component.array = array;
+		component.physical_to_logical = physical_to_logical;
+		component.array_capacity = record.array_capacity;
+		component.array_size = record.array_size;
+
+		// Invalidate all component handles.
+		++component.version;
 	}
+
+	Private::apply_image_records(*this, records);
+	return true;
 }
 
-void Context::clear()
+bool Context::save(char const* path) const
 {
 	assert(is_setup());
+	assert(!m_parallel_pass && "Files cannot be saved during parallel passes.");
 
-	// Reset all entity lists.
-	for (auto& entity_type : m_entity_types)
+	std::vector<char> records;
+	Private::write_image_records(*this, records, Private::mapped_image_magic, 0);
+
+	// Lay the arrays out after the records, aligned as in memory, and fill the array records
+	// which follow each component record.
+	Vector<Private::Image_arrays> arrays(m_components.size(), m_allocator);
+	uint64_t offset = records.size();
+	for (uint32_t i = 0; i < m_components.size(); ++i)
 	{
-#ifdef _DEBUG
-		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
-		{
-			auto& range = m_component_ranges[component_ref.component_range_global_index];
-			assert(range.logical_to_physical.size() == entity_type.generation.size());
-		}
-#endif
+		auto& component = m_components[i];
+		const size_t alignment = Private::get_array_alignment(*this, component);
 
-		entity_type.alive_count = 0;
+		arrays[i].array_offset = (offset + alignment - 1) / alignment * alignment;
+		offset = arrays[i].array_offset + (uint64_t)component.array_capacity * component.instance_size;
+		arrays[i].physical_to_logical_offset = (offset + alignof(uint32_t) - 1) / alignof(uint32_t) * alignof(uint32_t);
+		offset = arrays[i].physical_to_logical_offset + (uint64_t)component.array_capacity * sizeof(uint32_t);
 
-		// Make all entity indices free.
-		entity_type.free_indices.clear();
-		for (uint32_t i = 0; i < entity_type.generation.size(); ++i)
+		const size_t record_offset = sizeof(Private::Image_header) + (i + 1) * sizeof(Private::Image_component) + i * sizeof(Private::Image_arrays);
+		memcpy(records.data() + record_offset, &arrays[i], sizeof(arrays[i]));
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(records.data(), 1, records.size(), file) == records.size();
+	uint64_t position = records.size();
+	auto write_at = [&](uint64_t at, void const* data, size_t size)
+	{
+		static const char padding[256] = {};
+		while (ok && position < at)
 		{
-			entity_type.free_indices.push_back(i);
-			++entity_type.generation[i];
+			const size_t count = (size_t)std::min<uint64_t>(at - position, sizeof(padding));
+			ok = fwrite(padding, 1, count, file) == count;
+			position += count;
 		}
+
+		ok = ok && (!size || fwrite(data, 1, size, file) == size);
+		position += size;
+	};
+
+	for (uint32_t i = 0; i < m_components.size(); ++i)
+	{
+		auto& component = m_components[i];
+		write_at(arrays[i].array_offset, component.array, (size_t)component.array_capacity * component.instance_size);
+		write_at(arrays[i].physical_to_logical_offset, component.physical_to_logical, component.array_capacity * sizeof(uint32_t));
 	}
+
+	return fclose(file) == 0 && ok;
 }
 
-bool Context::is_alive(Entity entity) const
+bool Context::load(char const* path)
 {
 	assert(is_setup());
-	return	entity.type < m_entity_types.size() &&
-			m_entity_types[entity.type].generation[entity.index] == entity.generation;
-}
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
 
-Context::Component const* Context::find_component(size_t component_id) const
-{
-	for (auto& component : m_components)
-		if (component.id == component_id)
-			return &component;
-	return nullptr;
-}
+	Mapped_file mapped_file;
+	if (!mapped_file.open(path))
+		return false;
 
-Context::Entity_type* Context::find_create_entity_type(range<uintptr_t*> component_ids)
-{
-	// Sort the component ids to simplify search.
-	std::sort(component_ids.begin(), component_ids.end());
+	Private::Image_reader reader = { mapped_file.data(), mapped_file.data() + mapped_file.size() };
+	Private::Image records(m_allocator);
+	if (!Private::read_image_records(*this, reader, Private::mapped_image_magic, records))
+		return false;
 
-	// See if there's a previously defined entity type matching specified components. If so, just
-	// return that, no need to create the same entity type twice.
-	for (auto& entity_type : m_entity_types)
+	// Check the arrays lie within the file, aligned as in memory.
+	for (uint32_t i = 0; i < m_components.size(); ++i)
 	{
-		if (component_ids.size() != entity_type.components_count)
-			continue;
+		auto& component = m_components[i];
+		auto& arrays = records.arrays[i];
+		const uint64_t capacity = records.components[i].array_capacity;
+
+		if (arrays.array_offset > mapped_file.size() || capacity * component.instance_size > mapped_file.size() - arrays.array_offset ||
+			arrays.physical_to_logical_offset > mapped_file.size() || capacity * sizeof(uint32_t) > mapped_file.size() - arrays.physical_to_logical_offset ||
+			(uintptr_t)(mapped_file.data() + arrays.array_offset) % Private::get_array_alignment(*this, component) ||
+			(uintptr_t)(mapped_file.data() + arrays.physical_to_logical_offset) % alignof(uint32_t))
+			return false;
+	}
 
-		auto components_ref_range = Private::get_component_refs(*this, entity_type);
+	for (uint32_t i = 0; i < m_components.size(); ++i)
+	{
+		auto& component = m_components[i];
+		Private::free_array(*this, component);
 
-		uint32_t i = 0;
-		for (; i < component_ids.size(); ++i)
-			if (component_ids.begin()[i] != components_ref_range.begin()[i].component_id)
-				break;
+		component.array = mapped_file.data() + records.arrays[i].array_offset;
+		component.physical_to_logical = (uint32_t*)(mapped_file.data() + records.arrays[i].physical_to_logical_offset);
+		component.array_capacity = records.components[i].array_capacity;
+		component.array_size = records.components[i].array_size;
+		component.mapped = true;
 
-		if (i == component_ids.size())
-			return &entity_type;
+		// Invalidate all component handles.
+		++component.version;
 	}
 
-	// Entity type not found, create one.
-	auto components_ref_first = m_component_refs.size();
-		
-	for (auto component_id : component_ids)
-	{
-		m_component_refs.push_back({ component_id });
-		++find_component(component_id)->ranges_count;
-	}
+	Private::apply_image_records(*this, records);
 
-	m_entity_types.push_back({ components_ref_first, m_component_refs.size() - components_ref_first });
-	
-	return &m_entity_types.back();
+	// The previous mapping, if any, is not used anymore.
+	m_mapped_file = std::move(mapped_file);
+	return true;
 }
 
-void* Context::get_component_instance(Entity entity, uint32_t component_id)
+void Context::extract_entities(Entity const* entities, uint32_t count, std::vector<char>& blob) const
 {
-	assert(is_alive(entity));
+	assert(is_setup());
 
-	auto& entity_type = m_entity_types[entity.type];
-	auto components_ref_range = Private::get_component_refs(*this, entity_type);
-	
-	auto it = std::lower_bound(components_ref_range.begin(), components_ref_range.end(), component_id, [](Component_ref const& ref, uint32_t component_id)
-	{
-		return ref.component_id < component_id;
-	});
+	Vector<Entity> sorted_entities(entities, entities + count, m_allocator);
+	std::sort(sorted_entities.begin(), sorted_entities.end(), Private::entity_less);
+	assert(std::adjacent_find(sorted_entities.begin(), sorted_entities.end(), Private::entity_equal) == sorted_entities.end() && "Entities extracted more than once.");
+
+	uint32_t entity_type_count = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		entity_type_count += !i || sorted_entities[i].type != sorted_entities[i - 1].type;
 
-	if (it < components_ref_range.end() && it->component_id == component_id)
+	const Private::Blob_header header = { Private::blob_magic, entity_type_count, count };
+	Private::write_image(blob, &header, sizeof(header));
+
+	Vector<uint32_t> parents(m_allocator);
+	for (auto type_first = sorted_entities.begin(); type_first != sorted_entities.end();)
 	{
-		auto& component = m_components[it->component_index];
-		auto& range = m_component_ranges[it->component_range_global_index];
-		
-		// Get the physical index of the entity component instance within the component range.
-		const uint32_t physical_index = range.logical_to_physical[entity.index];
+		auto& entity_type = m_entity_types[type_first->type];
 
-		return component.array + physical_index * component.instance_size;
-	}
+		auto type_last = type_first;
+		while (type_last != sorted_entities.end() && type_last->type == type_first->type)
+			++type_last;
 
-	return nullptr;
+		const uint32_t entity_count = (uint32_t)(type_last - type_first);
+		const Private::Blob_entity_type record = { entity_type.components_count, entity_type.shared_count, entity_count };
+		Private::write_image(blob, &record, sizeof(record));
+
+		for (uint32_t i = entity_type.components_ref_first; i < entity_type.components_ref_first + entity_type.components_count; ++i)
+		{
+			auto& component = m_components[m_component_refs[i].component_index];
+			const Private::Blob_component component_record = { component.id, Private::compute_layout_hash(*this, component) };
+			Private::write_image(blob, &component_record, sizeof(component_record));
+		}
+
+		for (uint32_t i = entity_type.shared_first; i < entity_type.shared_first + entity_type.shared_count; ++i)
+		{
+			auto& shared_component = m_shared_components[i];
+			const Private::Blob_shared_component shared_record = { shared_component.component_id, shared_component.size, shared_component.alignment };
+			Private::write_image(blob, &shared_record, sizeof(shared_record));
+			Private::write_image(blob, shared_component.instance, shared_component.size);
+		}
+
+		for (auto it = type_first; it != type_last; ++it)
+			assert(is_alive(*it));
+		Private::write_image(blob, &*type_first, entity_count * sizeof(Entity));
+
+		// Parents are looked up among the extracted entities of the type, sorted by index.
+		parents.clear();
+		for (auto it = type_first; it != type_last; ++it)
+		{
+			const uint32_t parent = it->index < entity_type.hierarchy.size() ? entity_type.hierarchy[it->index].parent : (uint32_t)-1;
+			auto found = std::lower_bound(type_first, type_last, parent, [](Entity const& entity, uint32_t index) { return entity.index < index; });
+			parents.push_back(parent != (uint32_t)-1 && found != type_last && found->index == parent ? (uint32_t)(found - type_first) : (uint32_t)-1);
+		}
+		Private::write_image(blob, parents.data(), parents.size() * sizeof(uint32_t));
+
+		for (uint32_t i = entity_type.components_ref_first; i < entity_type.components_ref_first + entity_type.components_count; ++i)
+		{
+			auto& component_ref = m_component_refs[i];
+			auto& component = m_components[component_ref.component_index];
+			auto& component_range = m_component_ranges[component_ref.component_range_global_index];
+
+			for (auto& field : Private::get_component_fields(*this, component))
+			{
+				char const* field_array = component.array + (size_t)component.array_capacity * field.offset;
+				for (auto it = type_first; it != type_last; ++it)
+					Private::write_image(blob, field_array + (size_t)component_range.logical_to_physical[it->index] * field.size, field.size);
+			}
+		}
+
+		type_first = type_last;
+	}
 }
 
-uint32_t Context::define_foreach(std::initializer_list<uint32_t> component_ids)
+bool Context::insert_entities(void const* blob, size_t size, std::vector<Entity>& entities, std::vector<Entity>* source_entities)
 {
-	// See if we have already defined this combination of components.
-	const uint32_t num_components = component_ids.size();
-	for (auto& foreach : m_foreaches)
+	assert(is_setup());
+	assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+	Private::Image_reader reader = { (char const*)blob, (char const*)blob + size };
+
+	// Read and check all the records before creating any entity.
+	Private::Blob_header header;
+	if (!reader.read(header) || header.magic != Private::blob_magic)
+		return false;
+
+	Vector<Private::Blob_entity_type_ref> refs(m_allocator);
+	Vector<uint64_t> component_ids(m_allocator);
+	Vector<Shared_component> shared_components(m_allocator);
+	Vector<uint32_t> parents(m_allocator);
+	Vector<uint8_t> states(m_allocator);
+	uint32_t entity_count = 0;
+
+	for (uint32_t i = 0; i < header.entity_type_count; ++i)
 	{
-		if (num_components != foreach.component_id_count)
-			continue;
+		Private::Blob_entity_type record;
+		if (!reader.read(record) || !record.components_count)
+			return false;
 
-		for (uint32_t i = 0; i < foreach.component_id_count; ++i)
-			if (m_ids[foreach.component_id_first + i] != component_ids.begin()[i])
-				goto next_foreach;
+		component_ids.clear();
+		for (uint32_t j = 0; j < record.components_count; ++j)
+		{
+			Private::Blob_component component_record;
+			if (!reader.read(component_record))
+				return false;
+
+			Component const* component = find_component(component_record.component_id);
+			if (!component || Private::compute_layout_hash(*this, *component) != component_record.layout_hash)
+				return false;
+
+			component_ids.push_back(component_record.component_id);
+		}
+
+		shared_components.clear();
+		for (uint32_t j = 0; j < record.shared_count; ++j)
+		{
+			Private::Blob_shared_component shared_record;
+			if (!reader.read(shared_record))
+				return false;
+
+			// The instance is only compared to the ones of the entity types, it can be unaligned.
+			char const* instance = reader.skip(shared_record.size);
+			if (!instance)
+				return false;
+
+			shared_components.push_back({ shared_record.component_id, shared_record.size, shared_record.alignment, const_cast<char*>(instance) });
+		}
+
+		if (!std::is_sorted(component_ids.begin(), component_ids.end()) || !std::is_sorted(shared_components.begin(), shared_components.end(),
+			[](Shared_component const& a, Shared_component const& b) { return a.component_id < b.component_id; }))
+			return false;
+
+		Entity_type* entity_type = Private::find_entity_type(*this, make_range(component_ids.data(), component_ids.size()), make_range(shared_components.data(), shared_components.size()));
+		if (!entity_type)
+			return false;
+
+		Private::Blob_entity_type_ref ref;
+		ref.type = (Type)(entity_type - m_entity_types.data());
+		ref.entity_count = record.entity_count;
+		ref.entities = reader.skip((size_t)record.entity_count * sizeof(Entity));
+		ref.parents = reader.skip((size_t)record.entity_count * sizeof(uint32_t));
+		ref.instances = reader.it;
+		if (!ref.entities || !ref.parents)
+			return false;
+
+		// Parents must be in the blob and the trees must not have cycles: walk up from each
+		// entity until an entity already checked, marking the entities of the walk in progress.
+		parents.resize(record.entity_count);
+		if (record.entity_count)
+			memcpy(parents.data(), ref.parents, record.entity_count * sizeof(uint32_t));
+		states.assign(record.entity_count, 0);
+		for (uint32_t j = 0; j < record.entity_count; ++j)
+		{
+			uint32_t k = j;
+			for (; k != (uint32_t)-1 && k < record.entity_count && !states[k]; k = parents[k])
+				states[k] = 1;
+			if (k != (uint32_t)-1 && (k >= record.entity_count || states[k] == 1))
+				return false;
+			for (k = j; k != (uint32_t)-1 && states[k] == 1; k = parents[k])
+				states[k] = 2;
+		}
+
+		// The fields are written without the padding structure of arrays instances have.
+		size_t instances_size = 0;
+		for (auto& component_ref : Private::get_component_refs(*this, *entity_type))
+		{
+			for (auto& field : Private::get_component_fields(*this, m_components[component_ref.component_index]))
+				instances_size += field.size;
+		}
 
-		return &foreach - m_foreaches.data();
+		if (!reader.skip((size_t)record.entity_count * instances_size))
+			return false;
 
-	next_foreach:
-		;
+		refs.push_back(ref);
+		entity_count += record.entity_count;
 	}
 
-	// No matching foreach found, create a new one.
-	m_foreaches.push_back({ m_ids.size(), num_components, m_foreach_stmts.size(), 0 });
+	if (entity_count != header.entity_count || reader.it != reader.end)
+		return false;
 
-	// Insert covered component ids into the array of ids.
-	m_ids.insert(m_ids.end(), component_ids.begin(), component_ids.end());
+	const size_t entities_first = entities.size();
+	entities.resize(entities_first + entity_count);
+	if (source_entities)
+		source_entities->resize(entities_first + entity_count);
 
-	// Scan the list of entity types and see which ones match this foreach component list.
-	for (auto& entity_type : m_entity_types)
+	Entity* created = entities.data() + entities_first;
+	for (auto& ref : refs)
 	{
-		const uint32_t component_ref_index_first = m_ids.size();
+		auto& entity_type = m_entity_types[ref.type];
+		create_n(ref.type, ref.entity_count, created);
 
-		for (uint32_t i = 0; i < num_components; ++i)
+		char const* instances = ref.instances;
+		for (auto& component_ref : Private::get_component_refs(*this, entity_type))
 		{
-			for (uint32_t j = 0; j < entity_type.components_count; ++j)
+			auto& component = m_components[component_ref.component_index];
+			auto& component_range = m_component_ranges[component_ref.component_range_global_index];
+
+			for (auto& field : Private::get_component_fields(*this, component))
 			{
-				if (component_ids.begin()[i] == m_component_refs[entity_type.components_ref_first + j].component_id)
-				{
-					// Component found in entity type, carry one with the next component in foreach's
-					// component list.
-					m_ids.push_back(j);
-					goto next_component;
-				}
+				char* field_array = component.array + (size_t)component.array_capacity * field.offset;
+				for (uint32_t i = 0; i < ref.entity_count; ++i)
+					memcpy(field_array + (size_t)component_range.logical_to_physical[created[i].index] * field.size, instances + (size_t)i * field.size, field.size);
+				instances += (size_t)ref.entity_count * field.size;
 			}
+		}
 
-			// Component not found in entity type, stop search.
-			break;
-		
-		next_component:
-			;
+		// Parents are extracted with their children, the trees cannot have cycles.
+		for (uint32_t i = 0; i < ref.entity_count; ++i)
+		{
+			uint32_t parent;
+			memcpy(&parent, ref.parents + i * sizeof(uint32_t), sizeof(parent));
+			if (parent != (uint32_t)-1)
+				set_parent(created[i], created[parent]);
 		}
 
-		const uint32_t component_ref_index_count = m_ids.size() - component_ref_index_first;
+		if (source_entities)
+			memcpy(source_entities->data() + (created - entities.data()), ref.entities, ref.entity_count * sizeof(Entity));
 
-		// If all components have been mached, create the foreach statements otherwise undo any
-		// change made.
-		if (num_components == component_ref_index_count)
-			m_foreach_stmts.push_back({ (Type)(&entity_type - m_entity_types.data()), component_ref_index_first, component_ref_index_count });
-		else
-			m_ids.resize(component_ref_index_first);
+		created += ref.entity_count;
 	}
-	
-	m_foreaches.back().foreach_stmt_count = m_foreach_stmts.size() - m_foreaches.back().foreach_stmt_first;
 
-	return m_foreaches.size() - 1;
+	return true;
 }
 
 } // namespace entity
@@ -2,13 +2,55 @@
 #pragma once
 
 #include "libs.h"
+#include "allocator.h"
+#include "jobs.h"
+#include "mapped_file.h"
 #include <stdint.h>
 #include <vector>
 #include <array>
 #include <assert.h>
-#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+
+#ifdef ENTITY_COUNTERS
+#include <chrono>
+#endif
 
+#ifdef _MSC_VER
 #pragma warning(disable: 4200)
+#endif
+
+// Number of bits of an entity id used for its type and its generation, the remaining bits of the 64
+// bit id are used for its index. Trade index bits for generation bits, e.g. by defining
+// ENTITY_GENERATION_BITS to 24, when entity indices are reused often enough for the generation
+// counter to wrap around and stale ids to be seen alive. Must be defined the same way in all
+// translation units.
+#ifndef ENTITY_TYPE_BITS
+#define ENTITY_TYPE_BITS 16
+#endif
+
+#ifndef ENTITY_GENERATION_BITS
+#define ENTITY_GENERATION_BITS 16
+#endif
+
+#define ENTITY_INDEX_BITS (64 - ENTITY_TYPE_BITS - ENTITY_GENERATION_BITS)
+
+static_assert(ENTITY_TYPE_BITS <= 16, "Entity types ids are 16 bit.");
+static_assert(ENTITY_GENERATION_BITS <= 32, "Entity generations are at most 32 bit.");
+static_assert(ENTITY_INDEX_BITS <= 32, "Entity indices are at most 32 bit.");
+
+// Define ENTITY_COUNTERS to have contexts count the memory traffic of structural changes and time
+// foreaches, see `Context::counters()`. Must be defined the same way in all translation units.
+
+// Define ENTITY_CHANGE_TRACKING to have `Context::get()`, `Context::try_get()` and component handles
+// mark the range of the instance they return changed, see `Context::foreach_changed_since()`. Off
+// by default as it adds a store to each access. Must be defined the same way in all translation
+// units.
 
 namespace entity {
 
@@ -17,32 +59,413 @@ class Context;
 // The integer type of an entity type id.
 using Type = uint16_t;
 
+// The integer type generation counters are stored as, of which entity ids hold the low
+// ENTITY_GENERATION_BITS bits.
+using Generation = std::conditional<ENTITY_GENERATION_BITS <= 16, uint16_t, uint32_t>::type;
+
 // An entity is only a lightweight collection of three indices: the entity-type id, used to identify
 // which entity type (collection of components) the entity belongs to, a generation counter, used to
-// track entity lifetime and the actual entity index within the entity type.
+// track entity lifetime and the actual entity index within the entity type. The three indices are
+// packed in a single 64 bit word, so that entities compare and hash as one integer.
 // All entity operations are performed through a `Context` instance.
 struct Entity
 {
 	// The entity type id.
-	Type type;
+	uint64_t type : ENTITY_TYPE_BITS;
 
 	// The entity generation counter, for lifetime tracking.
-	uint16_t generation;
+	uint64_t generation : ENTITY_GENERATION_BITS;
 
 	// The entity index within its entity type.
-	uint32_t index;
+	uint64_t index : ENTITY_INDEX_BITS;
+
+	Entity() : type(((uint64_t)1 << ENTITY_TYPE_BITS) - 1), generation(0), index(0) {}
+
+	Entity(Type type, Generation generation, uint32_t index) : type(type), generation(generation), index(index) {}
+
+	// Returns the entity id as a single integer, with the index in the low bits followed by the
+	// generation and the type, e.g. to serialize it.
+	uint64_t value() const
+	{
+		return (uint64_t)index | (uint64_t)generation << ENTITY_INDEX_BITS | (uint64_t)type << (ENTITY_INDEX_BITS + ENTITY_GENERATION_BITS);
+	}
+
+	// Returns the entity whose `value()` is [value].
+	static Entity from_value(uint64_t value)
+	{
+		Entity entity;
+		entity.index = value;
+		entity.generation = value >> ENTITY_INDEX_BITS;
+		entity.type = value >> (ENTITY_INDEX_BITS + ENTITY_GENERATION_BITS);
+		return entity;
+	}
 
-	Entity() : type((Type)-1), generation(0), index(0) {}
+	// Returns whether this is the null entity `Entity()`, e.g. returned by `Context::get_parent()`
+	// for roots. Its type id is all ones in ENTITY_TYPE_BITS bits, which no entity type gets.
+	bool is_null() const { return type == Entity().type; }
 
-	Entity(Type type, uint16_t generation, uint32_t index) : type(type), generation(generation), index(index) {}
+	bool operator==(Entity const& other) const { return value() == other.value(); }
+	bool operator!=(Entity const& other) const { return value() != other.value(); }
 };
 
+static_assert(sizeof(Entity) == sizeof(uint64_t), "Entity ids must fit in a 64 bit word.");
+
 template <typename... Components>
 class Foreach_control;
 
+template <typename T>
+class Component_handle;
+
+// Components are stored as arrays of structures by default. Specialize this template for a
+// component type T, inheriting from `Soa<Fields...>` with the types of T fields in declaration
+// order, to have the Context store each field of T in its own array (structure of arrays), e.g.
+//
+//     template <> struct entity::Soa_layout<Transform> : entity::Soa<Vec3, Quat, Vec3> {};
+//
+// Foreach functions then receive a `Soa_ref<T>` instead of a `T&` and chunk foreach functions a
+// `Soa_array<T>` instead of a `T*`.
+template <typename T>
+struct Soa_layout
+{
+	static constexpr bool enabled = false;
+};
+
+// Offset of field I of a structure with specified list of field types.
+template <typename Fields, size_t I>
+struct Soa_field_offset
+{
+	using previous = typename std::tuple_element<I - 1, Fields>::type;
+	using current  = typename std::tuple_element<I, Fields>::type;
+
+	static constexpr size_t value = (Soa_field_offset<Fields, I - 1>::value + sizeof(previous) + alignof(current) - 1) / alignof(current) * alignof(current);
+};
+
+template <typename Fields>
+struct Soa_field_offset<Fields, 0>
+{
+	static constexpr size_t value = 0;
+};
+
+// Base of `Soa_layout` specializations, it lists the types of the fields of a component.
+template <typename... Fields>
+struct Soa
+{
+	static constexpr bool enabled = true;
+
+	// Tuple of the field types.
+	using fields = std::tuple<Fields...>;
+
+	// Tuple of pointers to each field.
+	using pointers = std::tuple<Fields*...>;
+};
+
+// Reference to a component instance stored as structure of arrays. Each field is accessed with
+// `get<I>()`, or the whole instance can be loaded and stored at once.
+template <typename T>
+class Soa_ref
+{
+public:
+	using fields = typename Soa_layout<T>::fields;
+
+	explicit Soa_ref(typename Soa_layout<T>::pointers const& pointers) : m_pointers(pointers) {}
+
+	// Returns a reference to field I.
+	template <size_t I>
+	typename std::tuple_element<I, fields>::type& get() const { return *std::get<I>(m_pointers); }
+
+	// Gathers all fields into an instance of T.
+	T load() const
+	{
+		T instance;
+		copy_fields(mp::build_indices<std::tuple_size<fields>::value>{}, [&](char* field, size_t offset, size_t size) { memcpy((char*)&instance + offset, field, size); });
+		return instance;
+	}
+
+	// Scatters all fields of [instance].
+	void store(T const& instance) const
+	{
+		copy_fields(mp::build_indices<std::tuple_size<fields>::value>{}, [&](char* field, size_t offset, size_t size) { memcpy(field, (char const*)&instance + offset, size); });
+	}
+
+private:
+	template <size_t... Is, typename Fn>
+	void copy_fields(mp::indices<Is...>, Fn fn) const
+	{
+		int expand[] = { 0, (fn((char*)std::get<Is>(m_pointers), Soa_field_offset<fields, Is>::value, sizeof(typename std::tuple_element<Is, fields>::type)), 0)... };
+		(void)expand;
+	}
+
+	typename Soa_layout<T>::pointers m_pointers;
+};
+
+// The arrays of the fields of a range of component instances stored as structure of arrays.
+template <typename T>
+class Soa_array
+{
+public:
+	using fields = typename Soa_layout<T>::fields;
+
+	Soa_array() {}
+
+	explicit Soa_array(typename Soa_layout<T>::pointers const& pointers) : m_pointers(pointers) {}
+
+	// Returns the array of field I.
+	template <size_t I>
+	typename std::tuple_element<I, fields>::type* field() const { return std::get<I>(m_pointers); }
+
+	// Returns a reference to the instance at index [i].
+	Soa_ref<T> operator[](uint32_t i) const { return Soa_ref<T>(offset(i, mp::build_indices<std::tuple_size<fields>::value>{})); }
+
+private:
+	template <size_t... Is>
+	typename Soa_layout<T>::pointers offset(uint32_t i, mp::indices<Is...>) const { return typename Soa_layout<T>::pointers{ std::get<Is>(m_pointers) + i... }; }
+
+	typename Soa_layout<T>::pointers m_pointers;
+};
+
+// Describes how instances of a component type T are laid out in the array of its instances and
+// how they are accessed.
+template <typename T, bool Soa = Soa_layout<T>::enabled>
+struct Component_access
+{
+	// Type of the arrays of instances passed to chunk foreach functions.
+	using array = T*;
+
+	// Type of a reference to a single instance.
+	using reference = T&;
+
+	// Number of separately stored fields.
+	static constexpr uint32_t field_count = 1;
+
+	// Writes the size and offset of each stored field into [sizes] and [offsets].
+	static void get_fields(uint32_t* sizes, uint32_t* offsets)
+	{
+		sizes[0] = sizeof(T);
+		offsets[0] = 0;
+	}
+
+	// Returns the array of instances starting at [physical_index] in instances array [data] that
+	// has capacity for [array_capacity] instances.
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index)
+	{
+		(void)array_capacity;
+		return reinterpret_cast<T*>(data) + physical_index;
+	}
+
+	// Default constructs [count] instances starting at [physical_index] in instances array [data].
+	static void construct(char* data, uint32_t array_capacity, uint32_t physical_index, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			new (make_array(data, array_capacity, physical_index + i)) T{};
+	}
+};
+
+// Structure of arrays instances are laid out in the same allocation as array of structures ones,
+// but each field I is stored in its own array starting at `array_capacity * offset(I)` bytes.
+template <typename T>
+struct Component_access<T, true>
+{
+	using fields = typename Soa_layout<T>::fields;
+	using array = Soa_array<T>;
+	using reference = Soa_ref<T>;
+
+	static constexpr uint32_t field_count = std::tuple_size<fields>::value;
+
+	static_assert(sizeof(T) == (Soa_field_offset<fields, field_count - 1>::value + sizeof(typename std::tuple_element<field_count - 1, fields>::type) + alignof(T) - 1) / alignof(T) * alignof(T),
+		"Soa_layout fields must match the component type fields.");
+
+	static void get_fields(uint32_t* sizes, uint32_t* offsets)
+	{
+		get_fields(sizes, offsets, mp::build_indices<field_count>{});
+	}
+
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index)
+	{
+		return make_array(data, array_capacity, physical_index, mp::build_indices<field_count>{});
+	}
+
+	static void construct(char* data, uint32_t array_capacity, uint32_t physical_index, uint32_t count)
+	{
+		const T instance{};
+		array instances = make_array(data, array_capacity, physical_index);
+		for (uint32_t i = 0; i < count; ++i)
+			instances[i].store(instance);
+	}
+
+private:
+	template <size_t... Is>
+	static void get_fields(uint32_t* sizes, uint32_t* offsets, mp::indices<Is...>)
+	{
+		int expand[] = { 0, (sizes[Is] = sizeof(typename std::tuple_element<Is, fields>::type), offsets[Is] = Soa_field_offset<fields, Is>::value, 0)... };
+		(void)expand;
+	}
+
+	template <size_t... Is>
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index, mp::indices<Is...>)
+	{
+		return array(typename Soa_layout<T>::pointers{ reinterpret_cast<typename std::tuple_element<Is, fields>::type*>(data + (size_t)array_capacity * Soa_field_offset<fields, Is>::value) + physical_index... });
+	}
+};
+
+// Marks a component of a `Foreach` component list that entities must not have. Entity types with
+// the component are skipped when the foreach is defined and no argument is passed for it.
+template <typename T>
+struct Without {};
+
+// Marks a component of a `Foreach` component list that entities may not have. A pointer to the
+// instance is passed for it, null if the entity does not have it, or a pointer to the array of
+// instances for chunk foreaches, null for the entity types that do not have it.
+template <typename T>
+struct Optional {};
+
+// Marks a component of a `Foreach` component list as shared by all entities of an entity type,
+// see `Context::define_shared()`. The foreach function gets a reference to the shared instance.
+template <typename T>
+struct Shared {};
+
+// How a component of a `Foreach` component list is matched against entity types.
+enum Match
+{
+	Match_required,
+	Match_optional,
+	Match_excluded,
+	Match_shared
+};
+
+// Array of the instances of an optional component, null if the entity type does not have it.
+template <typename T>
+struct Optional_array
+{
+	T* array = nullptr;
+
+	// Returns a pointer to the instance at index [i], null if there is no such component.
+	T* operator[](uint32_t i) const { return array ? array + i : nullptr; }
+
+	operator T*() const { return array; }
+};
+
+// Describes how a component T of a `Foreach` component list is matched against entity types and
+// passed to the foreach function.
+template <typename T>
+struct Foreach_component
+{
+	// The component type.
+	using component = T;
+
+	static constexpr Match match = Match_required;
+
+	// Whether an argument is passed to the foreach function for the component.
+	static constexpr bool is_argument = true;
+
+	// Whether the foreach function only reads the component, which is the case when it is listed
+	// as `const T`. Read only components are not considered modified by the foreach.
+	static constexpr bool read_only = false;
+
+	// Type of the arrays of instances the foreach function arguments are taken from.
+	using array = typename Component_access<T>::array;
+
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index)
+	{
+		return Component_access<T>::make_array(data, array_capacity, physical_index);
+	}
+};
+
+template <typename T>
+struct Foreach_component<const T>
+{
+	static_assert(!Soa_layout<T>::enabled, "Read only components stored as structure of arrays are not supported.");
+
+	using component = T;
+	static constexpr Match match = Match_required;
+	static constexpr bool is_argument = true;
+	static constexpr bool read_only = true;
+	using array = T const*;
+
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index)
+	{
+		return Component_access<T>::make_array(data, array_capacity, physical_index);
+	}
+};
+
+template <typename T>
+struct Foreach_component<Optional<T>>
+{
+	static_assert(!Soa_layout<typename std::remove_const<T>::type>::enabled, "Optional components stored as structure of arrays are not supported.");
+
+	using component = typename std::remove_const<T>::type;
+	static constexpr Match match = Match_optional;
+	static constexpr bool is_argument = true;
+	static constexpr bool read_only = std::is_const<T>::value;
+	using array = Optional_array<T>;
+
+	static array make_array(char* data, uint32_t array_capacity, uint32_t physical_index)
+	{
+		return array{ Component_access<T>::make_array(data, array_capacity, physical_index) };
+	}
+};
+
+// The instance of a shared component, the same for all the entities of a foreach statement.
+template <typename T>
+struct Shared_array
+{
+	T* instance = nullptr;
+
+	T& operator[](uint32_t) const { return *instance; }
+
+	operator T&() const { return *instance; }
+};
+
+template <typename T>
+struct Foreach_component<Shared<T>>
+{
+	using component = typename std::remove_const<T>::type;
+	static constexpr Match match = Match_shared;
+	static constexpr bool is_argument = true;
+	static constexpr bool read_only = std::is_const<T>::value;
+	using array = Shared_array<T>;
+
+	static array make_array(char* data, uint32_t, uint32_t) { return array{ reinterpret_cast<T*>(data) }; }
+};
+
+template <typename T>
+struct Foreach_component<Without<T>>
+{
+	using component = typename std::remove_const<T>::type;
+	static constexpr Match match = Match_excluded;
+	static constexpr bool is_argument = false;
+	static constexpr bool read_only = true;
+	using array = std::nullptr_t;
+
+	static array make_array(char*, uint32_t, uint32_t) { return nullptr; }
+};
+
+// Builds the `mp::indices` of the components of a `Foreach` component list that are passed to
+// the foreach function.
+template <typename Indices, size_t I, typename... Components>
+struct Foreach_argument_indices_builder;
+
+template <size_t... Is, size_t I>
+struct Foreach_argument_indices_builder<mp::indices<Is...>, I>
+{
+	using type = mp::indices<Is...>;
+};
+
+template <size_t... Is, size_t I, typename T, typename... Ts>
+struct Foreach_argument_indices_builder<mp::indices<Is...>, I, T, Ts...>
+	: std::conditional<Foreach_component<T>::is_argument,
+	                   Foreach_argument_indices_builder<mp::indices<Is..., I>, I + 1, Ts...>,
+	                   Foreach_argument_indices_builder<mp::indices<Is...>, I + 1, Ts...>>::type
+{
+};
+
+template <typename... Components>
+using Foreach_argument_indices = typename Foreach_argument_indices_builder<mp::indices<>, 0, Components...>::type;
+
 // This class is used to refer to a prepared entity foreach statement. This is a thin wrapper over
 // the foreach object living in the Context. This class is mainly used to wrap together the list
-// of components to iterate over and provide a convenient way to invoke the foreach.
+// of components to iterate over and provide a convenient way to invoke the foreach. Components
+// can be marked as `Without<T>`, `Optional<T>` or `Shared<T>`, and listed as `const T` when only
+// read, in which case foreach functions get a const reference (or pointer) to them.
 template <typename... Components>
 class Foreach
 {
@@ -62,6 +485,156 @@ enum Flags
 	Entity_destroyed = 2,
 };
 
+// Policies for laying out the instances of a component in its array.
+enum Storage
+{
+	// Component ranges are packed one after the other with no gaps in between. Growing a range
+	// that has no more space shifts all the following ranges of the same component, moving every
+	// instance they hold: creating an entity can cost O(n) in the instances of the entity types
+	// laid out after its own. When spawning many entities of early entity types, prefer
+	// `Storage_slack` or `Context::reserve()`.
+	Storage_packed,
+
+	// Each component range reserves some slack at its end that grows geometrically. A range that
+	// has no more space is moved to the end of the component array, so that growing is amortized
+	// O(1) regardless of how many entity types share the component, at the cost of some unused
+	// memory.
+	Storage_slack,
+};
+
+// Work done by a Context, see `Context::counters()`. The counters stay zero unless ENTITY_COUNTERS
+// is defined.
+struct Counters
+{
+	// Number of component ranges moved to make room, by growing a preceding range with packed
+	// storage or the range itself with slack storage.
+	uint64_t range_shifts;
+
+	// Number of component instances moved by range shifts.
+	uint64_t shifted_instances;
+
+	// Number of reallocations of component arrays.
+	uint64_t reallocations;
+
+	// Number of bytes of component instances and index arrays copied or moved by structural
+	// changes, reallocations, sorts and `shrink_to_fit()`.
+	uint64_t copied_bytes;
+};
+
+// Algorithm used by `Context::sort()`.
+enum Sort_method
+{
+	// Sorts in O(n log n), whatever the current order.
+	Sort_full,
+
+	// Insertion sort, in O(n) plus the number of entities out of order. Meant to keep entities
+	// sorted frame to frame when keys change little.
+	Sort_incremental,
+};
+
+// Records entity creations and destructions and component writes, to apply them later with
+// `Context::playback()`. This lets parallel foreaches and systems, during which the Context cannot
+// be modified, spawn and destroy entities. A command buffer is not thread safe, use one per
+// thread: `Context::command_buffer()` returns the one of the current worker.
+class Command_buffer
+{
+public:
+	// Identifies an entity whose creation is recorded in a command buffer.
+	struct Created
+	{
+		uint32_t index;
+	};
+
+	explicit Command_buffer(Allocator& allocator = default_allocator())
+		: m_creates(&allocator)
+		, m_commands(&allocator)
+		, m_data(&allocator)
+		, m_created(&allocator)
+	{
+	}
+
+	// Records the creation of an entity of specified [type].
+	Created create(Type type)
+	{
+		m_creates.push_back(type);
+		return { (uint32_t)m_creates.size() - 1 };
+	}
+
+	// Records the destruction of [entity]. Entities that are not alive anymore on playback are
+	// ignored, as well as entities destroyed more than once.
+	void destroy(Entity entity)
+	{
+		m_commands.push_back({ Command_destroy, 0, entity, (uint32_t)-1, 0 });
+	}
+
+	// Records the write of [instance] as the `Component` of [entity]. Entities that are not alive
+	// anymore on playback are ignored.
+	template <typename Component>
+	void set(Entity entity, Component const& instance)
+	{
+		push_set(entity, { (uint32_t)-1 }, mp::type_index<Component>::value(), &instance, sizeof(Component));
+	}
+
+	// Records the write of [instance] as the `Component` of the [created] entity.
+	template <typename Component>
+	void set(Created created, Component const& instance)
+	{
+		assert(created.index < m_creates.size());
+		push_set(Entity(), created, mp::type_index<Component>::value(), &instance, sizeof(Component));
+	}
+
+	// Returns whether no command has been recorded since the last playback.
+	bool empty() const { return m_creates.empty() && m_commands.empty(); }
+
+private:
+	friend class Context;
+
+	template <typename T>
+	using Vector = std::vector<T, Std_allocator<T>>;
+
+	enum Command_kind
+	{
+		Command_destroy,
+		Command_set
+	};
+
+	// A recorded destruction or write.
+	struct Command
+	{
+		Command_kind kind;
+
+		// `mp::type_index` of the component written.
+		uint32_t component_type_index;
+
+		// The entity destroyed or written to, unless created by this command buffer.
+		Entity entity;
+
+		// Index in `m_creates` of the entity written to, or -1.
+		uint32_t created_index;
+
+		// Offset in `m_data` of the component instance written.
+		uint32_t data_offset;
+	};
+
+	void push_set(Entity entity, Created created, uint32_t component_type_index, void const* instance, size_t size)
+	{
+		m_commands.push_back({ Command_set, component_type_index, entity, created.index, (uint32_t)m_data.size() });
+		m_data.insert(m_data.end(), (char const*)instance, (char const*)instance + size);
+	}
+
+	// Entity types of the recorded creations.
+	Vector<Type> m_creates;
+
+	// Recorded destructions and writes, in order.
+	Vector<Command> m_commands;
+
+	// Component instances written by the commands.
+	Vector<char> m_data;
+
+	// The entities created on playback, indexed like `m_creates`.
+	Vector<Entity> m_created;
+};
+
 // A context manages all entity operations. Start by defining entity types, i.e. the various possible
 // sets of components that make up the entities in your application. You can only create entities out
 // of a previously defined entity type. Entities created out of an entity type will be mapped to an
@@ -76,96 +649,544 @@ enum Flags
 class Context
 {
 public:
+	// Creates a context that makes all its allocations with [allocator], which must outlive the
+	// context.
+	explicit Context(Allocator& allocator = default_allocator());
+
 	~Context();
 
 	// Defines an entity type to have specified set of Components. The order of components is
-	// irrelevant. It returns the entity type id associated to specified set of Components.
-	// Call this function strictly before calling `setup()`.
+	// irrelevant. It returns the entity type id associated to specified set of Components. If
+	// [reserve_count] is not zero, room is reserved for that many entities of this type, see
+	// `reserve()`.
+	// Entity types defined after `setup()` get their component ranges appended to the component
+	// arrays and are added to the matching foreach instances, without moving existing instances.
 	template <typename... Components>
-	Type define()
+	Type define(uint32_t reserve_count = 0)
+	{
+		std::array<uint64_t, sizeof...(Components)> component_ids = { mp::type_id<Components>::value... };
+		add_components<0, Components...>();
+		const Type type = (Type)(find_create_entity_type(make_range(component_ids)) - m_entity_types.data());
+		if (reserve_count > m_entity_types[type].reserved_count)
+			reserve(type, reserve_count);
+		return type;
+	}
+
+	// Defines an entity type like `define()`, whose entities in addition share one instance of
+	// each of the Shared_components..., initialized to [shared]. Foreaches list them as
+	// `Shared<T>` to get a reference to the instance of each entity type they iterate over, and
+	// `get_shared()` accesses it. Entity types with the same components but shared instances that
+	// differ, compared bytewise, are different entity types, which groups the entities by shared
+	// values in component arrays and foreaches. Shared component types must therefore have no
+	// padding nor floating point members, whose equal values can differ bytewise. Parallel
+	// foreaches and systems should list shared components as `const`, and changes to them are not
+	// tracked by `foreach_changed_since()`.
+	template <typename... Components, typename... Shared_components>
+	Type define_shared(Shared_components const&... shared)
 	{
-		assert(!is_setup());
-		std::array<uintptr_t, sizeof...(Components)> component_ids = { mp::type_id<Components>::value... };
+		static_assert(sizeof...(Shared_components) > 0, "Entity types without shared components are defined with define().");
+
+		std::array<uint64_t, sizeof...(Components)> component_ids = { mp::type_id<Components>::value... };
+		std::array<Shared_component, sizeof...(Shared_components)> shared_components = { make_shared_component(shared)... };
 		add_components<0, Components...>();
-		return (Type)(find_create_entity_type(make_range(component_ids)) - m_entity_types.data());
+		return (Type)(find_create_entity_type(make_range(component_ids), make_range(shared_components)) - m_entity_types.data());
+	}
+
+	// Returns the instance of shared `Component` of entity type [type], which must have it.
+	// Modifying it does not merge entity types: if it becomes equal to the instance of another
+	// entity type with the same components, `define_shared()` given that value returns the entity
+	// type defined first.
+	template <typename Component>
+	Component& get_shared(Type type)
+	{
+		char* instance = find_shared_instance(type, mp::type_id<Component>::value);
+		assert(instance && "The entity type does not have the shared component.");
+		return *reinterpret_cast<Component*>(instance);
 	}
 
 	// Defines a foreach instances to iterate over specified list of Components. The order is
 	// important as it will match the order in which arguments are declared in the foreach function
 	// body.
-	// Call this function strictly before calling `setup()`.
+	// Foreach instances can also be defined after `setup()`.
 	template <typename... Components>
 	void define(entity::Foreach<Components...>& foreach)
 	{
-		assert(!is_setup());
-		foreach.m_index = define_foreach({ mp::type_id<Components>::value... });
+		foreach.m_index = define_foreach({ mp::type_id<typename Foreach_component<Components>::component>::value... }, { Foreach_component<Components>::match... }, { Foreach_component<Components>::read_only... });
 	}
 
 	// Optimizes and compiles previously defined entity types and foreach instances. After setting
-	// the context up, new entity types or foreach instances are not allowed to be defined and all
-	// entity operations (create, destroy, etc) are available, as well as invoking foreach
-	// statements.
-	void setup();
+	// the context up all entity operations (create, destroy, etc) are available, as well as
+	// invoking foreach statements. Entity types and foreach instances defined afterwards are not
+	// optimized. The [storage] policy determines how component ranges are laid out in memory. If
+	// [range_alignment] is not zero, the first instance of each component range is aligned to
+	// that many bytes (a power of two, e.g. 64 for a cache line), so that SIMD code can use aligned
+	// loads and threads working on different ranges don't share cache lines.
+	void setup(Storage storage = Storage_packed, uint32_t range_alignment = 0);
+
+	// Sets the relative frequencies of the defined foreach instances, indexed in definition order,
+	// such as a `foreach_profile()` recorded in a previous run. When set, `setup()` lays out entity
+	// types in component arrays so that the most frequent foreach instances iterate over memory as
+	// linearly as possible. Otherwise the foreach instances matching the most entity types are
+	// favored. Call this function strictly before calling `setup()`.
+	void set_foreach_profile(std::vector<uint64_t> profile);
+
+	// Returns the total number of entities each defined foreach instance has iterated over so far,
+	// indexed in definition order.
+	std::vector<uint64_t> foreach_profile() const;
+
+	// Returns the counters of the work done since the context was created or the counters reset.
+	// Only counted when ENTITY_COUNTERS is defined.
+	Counters const& counters() const { return m_counters; }
+
+	// Returns the total time in nanoseconds spent in each defined foreach instance since the
+	// context was created or the counters reset, indexed in definition order. Only timed when
+	// ENTITY_COUNTERS is defined.
+	std::vector<uint64_t> foreach_times() const;
+
+	// Resets the counters and foreach times to zero.
+	void reset_counters();
 
 	// Returns whether the Context has been set up.
 	bool is_setup() const { return m_components.size() && m_components[0].array_capacity; }
 
-	// Creates an entity of specified [type].
-	Entity create(Type type);
+	// Creates an entity of specified [type].
+	Entity create(Type type);
+
+	// Creates [count] entities of specified [type] and writes them into [entities]. This is
+	// equivalent to calling `create()` [count] times, but each component range is grown (and its
+	// following ranges shifted) only once, making it the preferred way to spawn many entities.
+	void create_n(Type type, uint32_t count, Entity* entities);
+
+	// Destroys [entity]. The entity must be alive.
+	void destroy(Entity entity);
+
+	// Destroys [count] [entities]. The entities must be alive and distinct. Component ranges are
+	// compacted once per entity type and component rather than once per entity.
+	void destroy_n(Entity const* entities, uint32_t count);
+
+	// Adds a default constructed `Component` to [entity], which must be alive and not have it, by
+	// moving it to the entity type with the same components plus `Component`. That entity type
+	// must have been defined. The components both entity types have are moved over and [entity]
+	// is updated to the new entity id, the previous one is not alive anymore.
+	template <typename Component>
+	void add_component(Entity& entity)
+	{
+		migrate(entity, mp::type_index<Component>::value(), true);
+	}
+
+	// Removes `Component` from [entity], which must be alive and have it, by moving it to the
+	// entity type with the same components but `Component`. That entity type must have been
+	// defined. [entity] is updated to the new entity id, the previous one is not alive anymore.
+	template <typename Component>
+	void remove_component(Entity& entity)
+	{
+		migrate(entity, mp::type_index<Component>::value(), false);
+	}
+
+	// Queues [entity] for destruction on the next call to `flush()`. The entity stays alive and
+	// accessible until then. Queueing the same entity more than once is allowed.
+	void destroy_deferred(Entity entity);
+
+	// Destroys all entities queued with `destroy_deferred()` that are still alive, compacting the
+	// component ranges of each entity type in one pass.
+	void flush();
+
+	// Destroys all entities without actually releasing any memory, see `shrink_to_fit()`. The
+	// cost is proportional to the number of entity types and components, not of entities.
+	void clear();
+
+	// Makes room for [count] entities of specified [type] so that creating up to that many does
+	// not reallocate or move any component instance. When called before `setup()` the room is
+	// allocated at setup, all at once. The reservation is kept by `shrink_to_fit()`.
+	void reserve(Type type, uint32_t count);
+
+	// Releases the memory of component arrays not used by live entities or reservations, packing
+	// the component ranges. Entity index arrays are kept, as they track the lifetime of entity ids
+	// already handed out.
+	void shrink_to_fit();
+
+	// Sorts the entities of specified [type] in increasing order of the keys [key_fn] returns
+	// given their `Component`, which the type must have, moving the instances of all components
+	// of the type together. Foreaches then visit the entities of the type in this order, until
+	// entities get created or destroyed. Entities with equal keys keep their relative order.
+	template <typename Component, typename Key_fn>
+	void sort(Type type, Key_fn key_fn, Sort_method method = Sort_full)
+	{
+		assert(is_setup());
+		assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+
+		const uint32_t component_type_index = mp::type_index<Component>::value();
+		const uint32_t component_index = component_type_index < m_component_index_lookup.size() ? m_component_index_lookup[component_type_index] : (uint32_t)-1;
+		assert(component_index != (uint32_t)-1 && m_component_range_lookup[type * m_components.size() + component_index] != (uint32_t)-1 && "Sorting by a component the entity type does not have.");
+
+		auto& component = m_components[component_index];
+		auto& component_range = m_component_ranges[m_component_range_lookup[type * m_components.size() + component_index]];
+		auto instances = Component_access<Component>::make_array(component.array, component.array_capacity, component_range.first_physical_index);
+
+		using Key = typename std::decay<decltype(key_fn(instances[0]))>::type;
+		const uint32_t count = m_entity_types[type].alive_count;
+
+		Vector<Key> keys(m_allocator);
+		keys.reserve(count);
+		for (uint32_t i = 0; i < count; ++i)
+			keys.push_back(key_fn(instances[i]));
+
+		// Order of the instances, by position in the component ranges.
+		Vector<uint32_t> order(count, 0, m_allocator);
+		for (uint32_t i = 0; i < count; ++i)
+			order[i] = i;
+
+		if (method == Sort_incremental)
+		{
+			for (uint32_t i = 1; i < count; ++i)
+			{
+				Key key = std::move(keys[i]);
+				uint32_t j = i;
+				for (; j > 0 && key < keys[j - 1]; --j)
+				{
+					keys[j] = std::move(keys[j - 1]);
+					order[j] = order[j - 1];
+				}
+				keys[j] = std::move(key);
+				order[j] = i;
+			}
+		}
+		else
+			std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+		reorder(type, order.data());
+		m_entity_types[type].hierarchy_dirty = true;
+	}
+
+	// Makes [parent] the parent of [child], detaching [child] from its previous parent if any.
+	// Both entities must be alive and of the same entity type, and [parent] must not be [child]
+	// nor one of its descendants. Passing `Entity()` as [parent] detaches [child], making it a
+	// root. Destroying an entity detaches its children, and entities moved to another entity type
+	// by `add_component()` or `remove_component()` lose their parent and children.
+	void set_parent(Entity child, Entity parent);
+
+	// Returns the parent of [entity], which must be alive, or the null entity `Entity()` if it has
+	// none, see `Entity::is_null()`.
+	Entity get_parent(Entity entity) const;
+
+	// Executes provided function [fn] over all instances of Components... belonging to a live
+	// entity, like `foreach()`, visiting each parent before its children (see `set_parent()`).
+	// The function is expected to take pointers to the Components of the parent of the entity,
+	// null for entities without parent, followed by references to the Components of the entity,
+	// e.g. to propagate world transforms in a single pass. Entity types whose hierarchy changed
+	// since they were last visited are first reordered depth first, so that the pass is linear.
+	// Components stored as structure of arrays are not supported.
+	template <typename Fn, typename... Components>
+	void foreach_hierarchy(entity::Foreach<Components...> foreach_, Fn fn)
+	{
+		assert(is_setup());
+		assert(!m_parallel_pass && "Structural changes are forbidden during parallel passes.");
+		assert(foreach_.m_index < m_foreaches.size() && "Executing undefined foreach.");
+		auto& foreach = m_foreaches[foreach_.m_index];
+		Foreach_timer timer(foreach.time);
+		Foreach_arrays<Components...> component_arrays;
+		for (auto& foreach_stmt : make_range(m_foreach_stmts.data() + foreach.foreach_stmt_first, foreach.foreach_stmt_count))
+		{
+			auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
+			if (!entity_type.alive_count)
+				continue;
+
+			order_hierarchy(foreach_stmt.entity_type_index);
 
-	// Destroys [entity]. The entity must be alive.
-	void destroy(Entity entity);
+			++m_change_version;
+			mark_changed(foreach, foreach_stmt);
+			unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
 
-	// Destroys all entities without actually releasing any memory.
-	void clear();
+			foreach.iteration_count += entity_type.alive_count;
+
+			uint32_t const* parent_positions = entity_type.parent_positions.data();
+			for (uint32_t j = 0, n = entity_type.alive_count; j < n; ++j)
+			{
+				invoke_foreach_hierarchy_fn(std::forward<Fn>(fn), component_arrays, j, parent_positions[j], Foreach_argument_indices<Components...>{});
+			}
+		}
+	}
 
 	// Returns whether [entity] is alive (has not been destroyed or context cleared).
 	bool is_alive(Entity entity) const;
 
 	// Retrieves the specified `Component` from given [entity]. If entity does not specify the
-	// content, nullptr is returned instead.
+	// content, nullptr is returned instead. Not available for components stored as structure of
+	// arrays.
 	template <typename Component>
 	Component* try_get(Entity entity)
 	{
 		assert(is_setup());
-		return static_cast<Component*>(get_component_instance(entity, mp::type_id<Component>::value));
+		static_assert(!Soa_layout<Component>::enabled, "Use get() to access components stored as structure of arrays.");
+		auto location = get_component_instance(entity, mp::type_index<Component>::value());
+		if (!location.component)
+			return nullptr;
+
+		mark_accessed(location.component_range_global_index);
+		return Component_access<Component>::make_array(location.component->array, location.component->array_capacity, location.physical_index);
 	}
 
-	// Retrieves the specified `Component` from given [entity]. If entity does not specify the
-	// content, nullptr is returned instead.
+	// Returns a handle to the specified `Component` of given [entity], which caches the location
+	// of the component instance until the next structural change affecting the component.
+	template <typename Component>
+	Component_handle<Component> handle(Entity entity)
+	{
+		assert(is_setup());
+		static_assert(!Soa_layout<Component>::enabled, "Handles to components stored as structure of arrays are not supported.");
+		Component_handle<Component> handle;
+		handle.m_context = this;
+		handle.m_entity = entity;
+		handle.m_component_type_index = mp::type_index<Component>::value();
+		handle.resolve();
+		return handle;
+	}
+
+	// Retrieves the specified `Component` from given [entity], which must have it. A `Soa_ref` is
+	// returned for components stored as structure of arrays.
 	template <typename Component>
-	Component& get(Entity entity)
+	typename Component_access<Component>::reference get(Entity entity)
 	{
 		assert(is_setup());
-		auto component = try_get<Component>(entity);
-		assert(component);
-		return *component;
+		auto location = get_component_instance(entity, mp::type_index<Component>::value());
+		assert(location.component);
+		mark_accessed(location.component_range_global_index);
+		return Component_access<Component>::make_array(location.component->array, location.component->array_capacity, location.physical_index)[0];
 	}
 
 	// Executes provided function [fn] over all instances of Components... in the context [ctx]
 	// belonging to a live entity. The function is expected to take a non-const reference to
-	// all Components and return void.
+	// all Components (a `Soa_ref` for those stored as structure of arrays) and return void.
 	template <typename Fn, typename... Components>
 	auto foreach(entity::Foreach<Components...> foreach_, Fn fn)
 	{
 		assert(is_setup());
 		assert(foreach_.m_index < m_foreaches.size() && "Executing undefined foreach.");
 		auto& foreach = m_foreaches[foreach_.m_index];
-		std::tuple<Components*...> component_arrays;
+		Foreach_timer timer(foreach.time);
+		Foreach_arrays<Components...> component_arrays;
+		++m_change_version;
 		for (auto& foreach_stmt : make_range(m_foreach_stmts.data() + foreach.foreach_stmt_first, foreach.foreach_stmt_count))
 		{
 			auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
 			assert(sizeof...(Components) == foreach_stmt.component_ref_index_count);
 	
+			mark_changed(foreach, foreach_stmt);
 			unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
+
+			foreach.iteration_count += entity_type.alive_count;
 			
 			for (uint32_t j = 0, n = entity_type.alive_count; j < n; ++j)
 			{
-				invoke_foreach_fn(std::forward<Fn>(fn), component_arrays, j, mp::build_indices<sizeof...(Components)>{});
+				invoke_foreach_fn(std::forward<Fn>(fn), component_arrays, j, Foreach_argument_indices<Components...>{});
+			}
+		}
+	}
+
+	// Executes provided function [fn] like `foreach()`, but only over the entity types whose
+	// instances of any of Components... may have been modified after the change [version], as
+	// returned by `change_version()`. Changes are tracked per component range: a range is
+	// considered modified by every foreach iterating over it with write access (the component is
+	// not listed as `const`) and by creating or destroying entities, and, if ENTITY_CHANGE_TRACKING
+	// is defined, by `get()`, `try_get()` and component handles accessing one of its instances.
+	template <typename Fn, typename... Components>
+	void foreach_changed_since(entity::Foreach<Components...> foreach_, uint64_t version, Fn fn)
+	{
+		assert(is_setup());
+		assert(foreach_.m_index < m_foreaches.size() && "Executing undefined foreach.");
+		auto& foreach = m_foreaches[foreach_.m_index];
+		Foreach_timer timer(foreach.time);
+		Foreach_arrays<Components...> component_arrays;
+		++m_change_version;
+		for (auto& foreach_stmt : make_range(m_foreach_stmts.data() + foreach.foreach_stmt_first, foreach.foreach_stmt_count))
+		{
+			auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
+			if (!entity_type.alive_count || !is_changed_since(foreach, foreach_stmt, version))
+				continue;
+
+			mark_changed(foreach, foreach_stmt);
+			unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
+
+			foreach.iteration_count += entity_type.alive_count;
+
+			for (uint32_t j = 0, n = entity_type.alive_count; j < n; ++j)
+			{
+				invoke_foreach_fn(std::forward<Fn>(fn), component_arrays, j, Foreach_argument_indices<Components...>{});
 			}
 		}
 	}
 
+	// Returns the current change version. Modifications made afterwards are visited by
+	// `foreach_changed_since()` given this version.
+	uint64_t change_version() const { return m_change_version; }
+
+	// Writes a binary image of all entities and component instances of the context to [image],
+	// to later return to this state with `restore()`. If [since_version] is not zero, the image
+	// is a delta that only holds the instances of component ranges changed since this change
+	// version (see `change_version()`), as tracked for `foreach_changed_since()`, and can only be
+	// restored into a context holding the state of an image taken at that version: writes through
+	// `get()`, `try_get()` and component handles are only part of delta images when
+	// ENTITY_CHANGE_TRACKING is defined. Entities queued by `destroy_deferred()` are not part of
+	// the image.
+	void snapshot(std::vector<char>& image, uint64_t since_version = 0) const;
+
+	// Restores the state of the [size] bytes [image] written by `snapshot()` from a context with
+	// the same definitions, set up the same way. A delta image requires the context change
+	// version to be the one the delta was taken since, i.e. the context must not have been
+	// accessed since it was restored from the base image. Returns false, leaving the context
+	// unchanged, if the image cannot be restored. Component handles must be resolved again and
+	// the queue of `destroy_deferred()` is dropped.
+	bool restore(void const* image, size_t size);
+
+	// Writes the state of the context to the file at [path], laid out for `load()` to use the
+	// component arrays in place. Returns false if the file cannot be written.
+	bool save(char const* path) const;
+
+	// Maps the file at [path] written by `save()` from a context with the same definitions, set
+	// up the same way, and uses its component arrays and physical to logical mappings in place
+	// instead of loading them. Writes to instances only copy the pages written to, and arrays are
+	// copied to allocated memory on the first structural change that reallocates them. Returns
+	// false, leaving the context unchanged, if the file cannot be mapped or was written with
+	// different definitions. Component handles must be resolved again and the queue of
+	// `destroy_deferred()` is dropped.
+	bool load(char const* path);
+
+	// Appends to [blob] the component instances, shared component values and parent links of the
+	// [count] [entities], which must be alive and distinct, for `insert_entities()` to recreate
+	// them in another context, e.g. the shard of the world of another process. Parent links to
+	// entities that are not extracted are dropped. The entities stay alive: destroy them to
+	// complete a move.
+	void extract_entities(Entity const* entities, uint32_t count, std::vector<char>& blob) const;
+
+	// Creates the entities of the [size] bytes [blob] written by `extract_entities()`, copying
+	// their component instances. Their entity types, shared component values included, must be
+	// defined in this context with the same component layouts. Appends the created entities to
+	// [entities] and, if not null, the extracted entity each was created from to
+	// [source_entities] at the same position, e.g. to remap the entity ids held by components.
+	// Returns false, creating nothing, if the blob does not match the definitions.
+	bool insert_entities(void const* blob, size_t size, std::vector<Entity>& entities, std::vector<Entity>* source_entities = nullptr);
+
+	// Executes provided function [fn] once per foreach statement with a non-empty range of live
+	// entities, passing the number of entities followed by a pointer to the contiguous array of
+	// each of Components... The function is expected to take `(uint32_t count, Components*...)`
+	// (a `Soa_array` for components stored as structure of arrays) and return void. Use this to
+	// write loops the compiler can vectorize or explicit SIMD code.
+	template <typename Fn, typename... Components>
+	void foreach_chunk(entity::Foreach<Components...> foreach_, Fn fn)
+	{
+		assert(is_setup());
+		assert(foreach_.m_index < m_foreaches.size() && "Executing undefined foreach.");
+		auto& foreach = m_foreaches[foreach_.m_index];
+		Foreach_timer timer(foreach.time);
+		Foreach_arrays<Components...> component_arrays;
+		++m_change_version;
+		for (auto& foreach_stmt : make_range(m_foreach_stmts.data() + foreach.foreach_stmt_first, foreach.foreach_stmt_count))
+		{
+			auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
+			if (!entity_type.alive_count)
+				continue;
+
+			mark_changed(foreach, foreach_stmt);
+			unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
+
+			foreach.iteration_count += entity_type.alive_count;
+
+			invoke_foreach_chunk_fn(std::forward<Fn>(fn), entity_type.alive_count, component_arrays, Foreach_argument_indices<Components...>{});
+		}
+	}
+
+	// Executes provided function [fn] over all instances of Components... belonging to a live
+	// entity, like `foreach()`, but concurrently on the Context job system. Each foreach statement
+	// is split into batches of entities aligned to cache line boundaries. The function [fn] is
+	// invoked concurrently from multiple threads and it must only access the components it is
+	// given. Structural changes (creating, destroying entities, clearing the context, etc.) are
+	// forbidden until this function returns.
+	template <typename Fn, typename... Components>
+	void parallel_foreach(entity::Foreach<Components...> foreach_, Fn fn)
+	{
+		assert(is_setup());
+		assert(foreach_.m_index < m_foreaches.size() && "Executing undefined foreach.");
+
+		struct Job
+		{
+			Context* context;
+			Fn* fn;
+			Foreach_batch const* batches;
+		};
+
+		Foreach_timer timer(m_foreaches[foreach_.m_index].time);
+
+		Vector<Foreach_batch> batches(m_allocator);
+		build_foreach_batches(foreach_.m_index, batches);
+
+		Job job{ this, &fn, batches.data() };
+
+		begin_parallel_pass();
+
+		job_system().run((uint32_t)batches.size(), [](void* data, uint32_t job_index, uint32_t worker_index)
+		{
+			auto& job = *static_cast<Job*>(data);
+			current_worker_index() = worker_index;
+			run_foreach_batch<Fn, Components...>(*job.context, *job.fn, job.batches[job_index]);
+		}, &job);
+
+		end_parallel_pass();
+	}
+
+	// Registers a system that runs [fn] over all instances of Components... belonging to a live
+	// entity on every `run_systems()` call, and returns its index. Systems run in registration
+	// order, except that systems which do not conflict run concurrently: two systems conflict if
+	// they iterate over the same entity type and access one of its components, one of them with
+	// write access. As with `parallel_foreach()`, [fn] is invoked concurrently from multiple threads
+	// and it must only access the components it is given.
+	template <typename Fn, typename... Components>
+	uint32_t add_system(entity::Foreach<Components...> foreach_, Fn fn)
+	{
+		assert(foreach_.m_index < m_foreaches.size() && "Adding a system with an undefined foreach.");
+
+		System system;
+		system.foreach_index = foreach_.m_index;
+		system.fn = new (m_allocator->allocate(sizeof(Fn), alignof(Fn))) Fn(std::move(fn));
+		system.run_batch = [](Context& context, void* fn, Foreach_batch const& batch)
+		{
+			run_foreach_batch<Fn, Components...>(context, *static_cast<Fn*>(fn), batch);
+		};
+		system.destroy = [](Allocator& allocator, void* fn)
+		{
+			static_cast<Fn*>(fn)->~Fn();
+			allocator.deallocate(fn, sizeof(Fn), alignof(Fn));
+		};
+
+		m_systems.push_back(system);
+		m_system_order.clear();
+
+		return (uint32_t)m_systems.size() - 1;
+	}
+
+	// Runs all the systems registered with `add_system()` on the Context job system. Systems that
+	// depend on each other are run in successive parallel passes, each made of the batches of
+	// entities of all the systems of the pass. Structural changes are forbidden until this
+	// function returns.
+	void run_systems();
+
+	// Sets the job system parallel operations run on. If [job_system] is null (the default) a
+	// `Thread_pool` owned by the Context is used. The job system must outlive the Context.
+	void set_job_system(Job_system* job_system) { m_job_system = job_system; }
+
+	// Returns the job system parallel operations run on.
+	Job_system& job_system();
+
+	// Returns the command buffer of the current worker during parallel foreaches and systems, to
+	// record structural changes from them. Outside of them, the command buffer of the first
+	// worker is returned.
+	Command_buffer& command_buffer();
+
+	// Applies and clears the commands recorded in the command buffers returned by
+	// `command_buffer()`. The entities of all recorded creations are created first, in bulk per
+	// entity type, then component writes are applied in recording order, worker after worker, and
+	// finally the recorded destructions are applied along the ones queued with
+	// `destroy_deferred()`, as by `flush()`.
+	void playback();
+
 	// Executes provided function [fn] over all instances of Components... in the context [ctx]
 	// belonging to a live entity. The function is expected to take a non-const reference to
 	// Foreach_control followed by all Components and return void.
@@ -177,17 +1198,42 @@ public:
 	}
 	
 private:
+	// Vector that allocates with the context allocator.
+	template <typename T>
+	using Vector = std::vector<T, Std_allocator<T>>;
+
+	// Hash maps that allocate with the context allocator.
+	template <typename Key, typename T>
+	using Hash_map = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>, Std_allocator<std::pair<const Key, T>>>;
+	template <typename Key, typename T>
+	using Hash_multimap = std::unordered_multimap<Key, T, std::hash<Key>, std::equal_to<Key>, Std_allocator<std::pair<const Key, T>>>;
+
 	// Wraps info about a component type.
 	struct Component
 	{
-		// The id of the component equal to mp::type_of<Component>::value.
-		uintptr_t id;
+		// The stable id of the component equal to `mp::type_id<Component>::value`.
+		uint64_t id;
 
 		// Size in bytes of a single instance of this component.
 		uint32_t instance_size;
 
-		// Wraps the instance default constructor.
-		void (*construct)(void*);
+		// Alignment in bytes of this component type.
+		uint32_t alignment;
+
+		// Wraps the instance default constructor, it constructs [count] instances starting at
+		// [physical_index] in an instances [array] of [array_capacity] instances.
+		void (*construct)(char* array, uint32_t array_capacity, uint32_t physical_index, uint32_t count);
+
+		// Index of the first field of this component in `m_component_fields`.
+		uint32_t fields_first;
+
+		// Number of separately stored fields of this component, one unless the component is stored
+		// as structure of arrays.
+		uint32_t fields_count;
+
+		// Incremented every time instances of this component are moved or destroyed, used to
+		// detect stale component handles.
+		uint64_t version;
 
 		// Index of the first range associated to this component in `m_component_ranges`.
 		uint32_t ranges_first;
@@ -203,10 +1249,49 @@ private:
 		// Capacity (number of instances) the array allocation can hold.
 		uint32_t array_capacity;
 
+		// Number of instances of the array used by the ranges, including their slack (only used
+		// by `Storage_slack`).
+		uint32_t array_size;
+
 		// Array of component instances.
 		char*    array;
+
+		// Component ranges start at physical indices multiple of this number.
+		uint32_t range_granularity;
+
+		// Whether `array` and `physical_to_logical` point into the file mapped by `load()`. They
+		// are copied to allocated memory the first time they need to be reallocated.
+		bool mapped;
 	};
 	
+	// A separately stored field of a component. The array of field instances starts at
+	// `array_capacity * offset` bytes in the component array.
+	struct Component_field
+	{
+		// Size in bytes of the field.
+		uint32_t size;
+
+		// Offset of the field within the component type.
+		uint32_t offset;
+	};
+
+	// Location of a component instance.
+	struct Component_location
+	{
+		// The component the instance belongs to, null if the instance does not exist.
+		Component const* component;
+
+		// Physical index of the instance in the component array.
+		uint32_t physical_index;
+
+		// Index in `m_component_ranges` of the range the instance belongs to.
+		uint32_t component_range_global_index;
+	};
+
+	// Tuple of the arrays of specified Components types a foreach iterates over.
+	template <typename... Components>
+	using Foreach_arrays = std::tuple<typename Foreach_component<Components>::array...>;
+
 	// Identifies a range of components in the component array.
 	struct Component_range
 	{
@@ -220,10 +1305,27 @@ private:
 
 		// Index of the first component in the component array.
 		uint32_t first_physical_index;
+
+		// Number of instances this range can hold before growing (only used by `Storage_slack`).
+		uint32_t capacity;
+
+		// Change version of the last access that may have modified instances of this range, see
+		// `change_version()`.
+		uint64_t change_version;
 		
 		// Mapping of entity index to component index in component ranges associated to this entity
 		// type before range shifting.
-		std::vector<uint32_t> logical_to_physical;
+		Vector<uint32_t> logical_to_physical;
+	};
+
+	// Links of an entity to its parent, first child and siblings, by entity index within its
+	// entity type, -1 if there is none.
+	struct Hierarchy_node
+	{
+		uint32_t parent;
+		uint32_t first_child;
+		uint32_t next_sibling;
+		uint32_t prev_sibling;
 	};
 
 	// Wraps info about an entity type (collection of components).
@@ -238,19 +1340,62 @@ private:
 		// Number of live entities of this type; also the span of each Component_range.
 		uint32_t alive_count;
 
+		// Number of entities room is reserved for in each Component_range.
+		uint32_t reserved_count;
+
 		// Array of generation counters per entity index, used to track entity lifetime.
-		std::vector<uint16_t> generation;
-		
-		// Deque of indices free to be used. #todo this should be optimized to a linked list of
-		// indices instead reusing the index arrays like logical_to_physical.
-		std::deque<uint32_t> free_indices;
+		Vector<Generation> generation;
+
+		// Entity indices below this one are either alive or in the free list. The ones at or above
+		// it are free since the last `clear()`, their generation is bumped when they are reused.
+		uint32_t recycle_first;
+
+		// First and last entity index of the list of free indices, -1 if the list is empty. The
+		// list is threaded through the `logical_to_physical` array of the first component range,
+		// which free indices do not use: the entry of a free index holds the next free index.
+		uint32_t free_first;
+		uint32_t free_last;
+
+		// Number of indices in the free list.
+		uint32_t free_count;
+
+		// Index of the first shared component of this entity type in `m_shared_components`, and
+		// number of shared components, sorted by component id.
+		uint32_t shared_first;
+		uint32_t shared_count;
+
+		// Parent and child links per entity index, see `set_parent()`. Empty until a parent is
+		// set, indices past its end have no links.
+		Vector<Hierarchy_node> hierarchy;
+
+		// Position in the component ranges of the parent of the entity at each position, -1 for
+		// entities without parent. Only valid while `hierarchy_dirty` is false.
+		Vector<uint32_t> parent_positions;
+
+		// Whether the entities have been created, destroyed, reparented or moved since the
+		// component ranges were last ordered parents first by `order_hierarchy()`.
+		bool hierarchy_dirty;
+	};
+
+	// A component shared by all the entities of an entity type, see `define_shared()`.
+	struct Shared_component
+	{
+		// Id of the component.
+		uint64_t component_id;
+
+		// Size and alignment in bytes of the component type.
+		uint32_t size;
+		uint32_t alignment;
+
+		// The shared instance.
+		char* instance;
 	};
 	
 	// Entity type reference to a component type.
 	struct Component_ref
 	{
 		// Id of the component.
-		uintptr_t component_id;
+		uint64_t component_id;
 
 		// Index of the component in `m_components`.
 		uint32_t component_index;
@@ -273,6 +1418,35 @@ private:
 
 		// Number of foreach statements.
 		uint32_t foreach_stmt_count;
+
+		// Total number of entities this foreach iterated over, see `foreach_profile()`.
+		uint64_t iteration_count;
+
+		// Total time in nanoseconds spent in this foreach, see `foreach_times()`.
+		uint64_t time;
+
+		// Bit masks of the components in this foreach component list that are optional, excluded,
+		// only read or shared.
+		uint32_t optional_mask;
+		uint32_t excluded_mask;
+		uint32_t read_only_mask;
+		uint32_t shared_mask;
+	};
+
+	// Adds the time spent in its scope to a foreach time when ENTITY_COUNTERS is defined, does
+	// nothing otherwise.
+	struct Foreach_timer
+	{
+#ifdef ENTITY_COUNTERS
+		explicit Foreach_timer(uint64_t& time) : time(time), start(std::chrono::steady_clock::now()) {}
+
+		~Foreach_timer() { time += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(); }
+
+		uint64_t& time;
+		std::chrono::steady_clock::time_point start;
+#else
+		explicit Foreach_timer(uint64_t&) {}
+#endif
 	};
 
 	// A foreach statement, that provides info about an entity providing this foreach component list.
@@ -281,13 +1455,42 @@ private:
 		// Index in `m_entity_types` of entity type it stmt iterates over.
 		Type  entity_type_index;
 		
-		// Index in `m_ids` of the first index in this stmt entity type component refs.
+		// Index in `m_ids` of the first index in this stmt entity type component refs, -1 for the
+		// optional components the entity type does not have and the excluded ones. Shared
+		// components are indexed in `m_shared_components` instead.
 		uint32_t component_ref_index_first;
 
 		// #todo remove
 		uint32_t component_ref_index_count;
 	};
 
+	// A batch of entities of a foreach statement processed by a parallel foreach job.
+	struct Foreach_batch
+	{
+		// Index in `m_foreach_stmts` of the statement the batch belongs to.
+		uint32_t foreach_stmt_index;
+
+		// Range of iteration indices [first, last) within the statement entity type.
+		uint32_t first;
+		uint32_t last;
+	};
+
+	// A system registered with `add_system()`.
+	struct System
+	{
+		// Index in `m_foreaches` of the foreach the system iterates with.
+		uint32_t foreach_index;
+
+		// Copy of the system function.
+		void* fn;
+
+		// Invokes [fn] over the entities of a batch.
+		void (*run_batch)(Context& context, void* fn, Foreach_batch const& batch);
+
+		// Destroys and frees [fn].
+		void (*destroy)(Allocator& allocator, void* fn);
+	};
+
 private:
 	// Tests each component type T whether is already in the `m_components` array and if it isn't
 	// it adds it.
@@ -299,10 +1502,24 @@ private:
 		static_assert(std::is_trivially_destructible<T>::value, "Components type must be trivially destructible.");
 
 		auto component = find_component(mp::type_id<T>::value);
+		assert((!component || (mp::type_index<T>::value() < m_component_index_lookup.size() && &m_components[m_component_index_lookup[mp::type_index<T>::value()]] == component))
+			&& "Component type id collision, specialize mp::type_id to give one of the types an explicit id.");
 		if (!component)
 		{
-			static_assert(alignof(T) <= alignof(double), "Alignment greater than double not supported.");
-			m_components.push_back(Component{ mp::type_id<T>::value, sizeof(T), [](void* ptr) { new (ptr) T{}; } });
+			// Map the type index of the component to its index.
+			const uint32_t type_index = mp::type_index<T>::value();
+			if (type_index >= m_component_index_lookup.size())
+				m_component_index_lookup.resize(type_index + 1, (uint32_t)-1);
+			m_component_index_lookup[type_index] = (uint32_t)m_components.size();
+			m_component_indices.emplace(mp::type_id<T>::value, (uint32_t)m_components.size());
+
+			m_components.push_back(Component{ mp::type_id<T>::value, sizeof(T), alignof(T), &Component_access<T>::construct, (uint32_t)m_component_fields.size(), Component_access<T>::field_count,
+				0, 0, 0, nullptr, 0, 0, nullptr, 0, false });
+
+			std::array<uint32_t, Component_access<T>::field_count> sizes, offsets;
+			Component_access<T>::get_fields(sizes.data(), offsets.data());
+			for (uint32_t i = 0; i < Component_access<T>::field_count; ++i)
+				m_component_fields.push_back({ sizes[i], offsets[i] });
 		}
 		add_components<I + 1, Ts...>();
 	}
@@ -311,21 +1528,104 @@ private:
 	template <size_t I>
 	void add_components() {}
 
-	// Finds component with specified [component_id] ( O(n) complexity ).
-	Component const* find_component(size_t component_id) const;
+	// Describes the shared component [instance] passed to `define_shared()`.
+	template <typename T>
+	static Shared_component make_shared_component(T const& instance)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Shared components type must be trivially copyable.");
+		static_assert(__has_unique_object_representations(T), "Shared components are compared bytewise, their type must have no padding nor floating point members.");
+		return { mp::type_id<T>::value, sizeof(T), alignof(T), (char*)&instance };
+	}
+
+	// Finds component with specified [component_id].
+	Component const* find_component(uint64_t component_id) const;
 
-	// Finds component with specified [component_id] ( O(n) complexity ).
-	Component*       find_component(size_t component_id) { return const_cast<Component*>(static_cast<Context const*>(this)->find_component(component_id)); }
+	// Finds component with specified [component_id].
+	Component*       find_component(uint64_t component_id) { return const_cast<Component*>(static_cast<Context const*>(this)->find_component(component_id)); }
 
 	// Checks whether an entity type with specifier components has already been defined and if it
 	// isn't it adds a new entity type and returns a pointer to it.
-	Entity_type* find_create_entity_type(range<uintptr_t*> component_ids);
+	// Entity types with shared components also match on their [shared_components] instances, which
+	// are copied.
+	Entity_type* find_create_entity_type(range<uint64_t*> component_ids, range<Shared_component*> shared_components = { nullptr, nullptr });
+
+	// Returns the instance of the shared component with specified [component_id] of entity type
+	// [type], or null.
+	char* find_shared_instance(Type type, uint64_t component_id);
+
+	// Moves [entity] to the entity type that has the same components plus ([add]) or but the
+	// component of specified `mp::type_index`, updating [entity] to the new entity id.
+	void migrate(Entity& entity, uint32_t component_type_index, bool add);
+
+	// Fetches the location of the component instance that belongs to specified [entity], given
+	// the component `mp::type_index`. The lookup is made of indexed loads only: component index
+	// from type index, component range from the entity type and component index table, physical
+	// index from the range logical to physical mapping.
+	Component_location get_component_instance(Entity entity, uint32_t component_type_index)
+	{
+		assert(is_alive(entity));
+
+		if (component_type_index >= m_component_index_lookup.size())
+			return { nullptr, 0, 0 };
+
+		const uint32_t component_index = m_component_index_lookup[component_type_index];
+		if (component_index == (uint32_t)-1)
+			return { nullptr, 0, 0 };
+
+		const uint32_t component_range_global_index = m_component_range_lookup[entity.type * m_components.size() + component_index];
+		if (component_range_global_index == (uint32_t)-1)
+			return { nullptr, 0, 0 };
+
+		return { &m_components[component_index], m_component_ranges[component_range_global_index].logical_to_physical[entity.index], component_range_global_index };
+	}
+
+	// Moves the instances of all component ranges of entity type [type] so that the instance at
+	// position `order[i]` in the ranges ends up at position `i`.
+	void reorder(Type type, uint32_t const* order);
+
+	// Reorders the component ranges of entity type [type] depth first if its hierarchy is dirty,
+	// roots in their current order, and computes the parent position of each entity.
+	void order_hierarchy(Type type);
+
+	// Starts a parallel pass, during which structural changes are forbidden, making sure each
+	// worker has a command buffer.
+	void begin_parallel_pass();
+
+	// Ends the parallel pass.
+	void end_parallel_pass();
+
+	// Returns the index of the worker running the current job of a parallel pass on this thread.
+	static uint32_t& current_worker_index()
+	{
+		static thread_local uint32_t worker_index = 0;
+		return worker_index;
+	}
+
+	// Stamps the component ranges [foreach_stmt] of [foreach] writes to with the current change
+	// version.
+	void mark_changed(Foreach const& foreach, Foreach_stmt const& foreach_stmt);
+
+	// Stamps the component range at [component_range_global_index] with a new change version
+	// when ENTITY_CHANGE_TRACKING is defined, does nothing otherwise.
+	void mark_accessed(uint32_t component_range_global_index)
+	{
+#ifdef ENTITY_CHANGE_TRACKING
+		m_component_ranges[component_range_global_index].change_version = ++m_change_version;
+#else
+		(void)component_range_global_index;
+#endif
+	}
+
+	// Returns whether any of the component ranges [foreach_stmt] of [foreach] iterates over has
+	// been stamped after change [version].
+	bool is_changed_since(Foreach const& foreach, Foreach_stmt const& foreach_stmt, uint64_t version) const;
 
-	// Fetches the component instance that belongs to specified [entity].
-	void* get_component_instance(Entity entity, uint32_t component_id);
+	// Splits the statements of specified foreach into batches for a parallel foreach.
+	void build_foreach_batches(uint32_t foreach_index, Vector<Foreach_batch>& batches);
 
-	// Defines a foreach statement with given components and returns its index in `m_foreaches`.
-	uint32_t define_foreach(std::initializer_list<uint32_t> component_ids);
+	// Defines a foreach statement with given components, matched as specified by [matches] and
+	// accessed as specified by [read_only], and returns its index in `m_foreaches`.
+	uint32_t define_foreach(std::initializer_list<uint64_t> component_ids, std::initializer_list<Match> matches, std::initializer_list<bool> read_only);
 	
 	// Runs the controlled foreach.
 	template <typename Fn, typename... Components>
@@ -335,7 +1635,9 @@ private:
 		assert(foreach_index < m_foreaches.size() && "Executing undefined foreach.");
 
 		auto& foreach = m_foreaches[foreach_index];
-		std::tuple<Components*...> component_arrays;
+		Foreach_timer timer(foreach.time);
+		Foreach_arrays<Components...> component_arrays;
+		++m_change_version;
 		Foreach_control<Components...> control{ this, foreach_index, &foreach_stmt_index, &iteration };
 
 		for (; foreach_stmt_index < foreach.foreach_stmt_count; ++foreach_stmt_index)
@@ -344,15 +1646,18 @@ private:
 			auto& entity_type = m_entity_types[foreach_stmt.entity_type_index];
 			assert(sizeof...(Components) == foreach_stmt.component_ref_index_count);
 	
+			mark_changed(foreach, foreach_stmt);
 			unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
 
 			control.m_type = foreach_stmt.entity_type_index;
 
+			foreach.iteration_count += entity_type.alive_count - iteration;
+
 			for (; iteration < entity_type.alive_count; ++iteration)
 			{
 				control.m_flags = 0;
 				
-				invoke_foreach_fn(std::forward<Fn>(fn), control, component_arrays, iteration, mp::build_indices<sizeof...(Components)>{});
+				invoke_foreach_fn(std::forward<Fn>(fn), control, component_arrays, iteration, Foreach_argument_indices<Components...>{});
 
 				if (control.is_flag_set(Entity_created))
 				{
@@ -368,16 +1673,46 @@ private:
 		}
 	}
 
+	// Runs [fn] over the entities of [batch] of a foreach over Components...
+	template <typename Fn, typename... Components>
+	static void run_foreach_batch(Context& context, Fn& fn, Foreach_batch const& batch)
+	{
+		auto& foreach_stmt = context.m_foreach_stmts[batch.foreach_stmt_index];
+		auto& entity_type = context.m_entity_types[foreach_stmt.entity_type_index];
+
+		Foreach_arrays<Components...> component_arrays;
+		context.template unwrap_component_arrays<0, decltype(component_arrays), Components...>(component_arrays, entity_type.components_ref_first, foreach_stmt.component_ref_index_first);
+
+		for (uint32_t j = batch.first; j < batch.last; ++j)
+		{
+			invoke_foreach_fn(fn, component_arrays, j, Foreach_argument_indices<Components...>{});
+		}
+	}
+
 	// Helper function that sets the typed component arrays into specified tuple [arrays].
 	template <int I, typename Tuple, typename T, typename... Ts>
 	void unwrap_component_arrays(Tuple& arrays, uint32_t component_ref_first, uint32_t component_ref_index_first)
 	{
-		auto& component_ref = m_component_refs[component_ref_first + m_ids[component_ref_index_first + I]];
-		auto& component = m_components[component_ref.component_index];
-		auto& range = m_component_ranges[component_ref.component_range_global_index];
-		
-		std::get<I>(arrays) = reinterpret_cast<T*>(component.array + range.first_physical_index * component.instance_size);
-		
+		const uint64_t component_ref_index = m_ids[component_ref_index_first + I];
+
+		// Optional components the entity type does not have and excluded components.
+		if (component_ref_index == (uint64_t)-1)
+		{
+			std::get<I>(arrays) = typename Foreach_component<T>::array{};
+		}
+		else if (Foreach_component<T>::match == Match_shared)
+		{
+			std::get<I>(arrays) = Foreach_component<T>::make_array(m_shared_components[component_ref_index].instance, 0, 0);
+		}
+		else
+		{
+			auto& component_ref = m_component_refs[component_ref_first + component_ref_index];
+			auto& component = m_components[component_ref.component_index];
+			auto& range = m_component_ranges[component_ref.component_range_global_index];
+
+			std::get<I>(arrays) = Foreach_component<T>::make_array(component.array, component.array_capacity, range.first_physical_index);
+		}
+
 		unwrap_component_arrays<I + 1, Tuple, Ts...>(arrays, component_ref_first, component_ref_index_first);
 	}
 
@@ -403,32 +1738,218 @@ private:
 		return fn(control, std::get<Is>(args)[i]...);
 	}
 
+	// Helper function that invokes a hierarchy foreach function from specified component arrays
+	// [args], iteration index [i] and position of the parent [parent], -1 if there is none.
+	template <typename Fn, typename Tuple, size_t... Is>
+	static void invoke_foreach_hierarchy_fn(Fn fn, Tuple const& args, uint32_t i, uint32_t parent, mp::indices<Is...>)
+	{
+		return fn(parent_argument(std::get<Is>(args), parent)..., std::get<Is>(args)[i]...);
+	}
+
+	// Returns a pointer to the instance of the parent at position [parent] in [array], or null if
+	// there is no parent.
+	template <typename T>
+	static T* parent_argument(T* array, uint32_t parent)
+	{
+		return parent != (uint32_t)-1 ? array + parent : nullptr;
+	}
+
+	template <typename T>
+	static T* parent_argument(Optional_array<T> const& array, uint32_t parent)
+	{
+		return parent != (uint32_t)-1 ? array[parent] : nullptr;
+	}
+
+	template <typename T>
+	static T* parent_argument(Shared_array<T> const& array, uint32_t parent)
+	{
+		return parent != (uint32_t)-1 ? array.instance : nullptr;
+	}
+
+	// Helper function that invokes a chunk foreach function from specified component arrays [args]
+	// and number of entities [count].
+	template <typename Fn, typename Tuple, size_t... Is>
+	static void invoke_foreach_chunk_fn(Fn fn, uint32_t count, Tuple const& args, mp::indices<Is...>)
+	{
+		return fn(count, std::get<Is>(args)...);
+	}
+
 	// Structure that contains helper functions defined in the cpp.
 	struct Private;
 
 private:
 	template <typename...> friend class Foreach_control;
+	template <typename> friend class Component_handle;
+
+	// The allocator all allocations are made with.
+	Allocator* m_allocator;
 
 	// Array of indices, used to index heterogeneous arrays.
-	std::vector<uintptr_t> m_ids;
+	Vector<uint64_t> m_ids;
+
+	// Index in `m_components` of each component id.
+	Hash_map<uint64_t, uint32_t> m_component_indices;
+
+	// Entity types and foreach instances by hash of their component lists, see
+	// `find_create_entity_type()` and `define_foreach()`.
+	Hash_multimap<uint64_t, Type> m_entity_type_indices;
+	Hash_multimap<uint64_t, uint32_t> m_foreach_indices;
+
+	// Shared components of the entity types.
+	Vector<Shared_component> m_shared_components;
+
+	// For each component, the bitset of the entity types that have it, as a row of
+	// `m_component_entity_types_words` words.
+	Vector<uint64_t> m_component_entity_types;
+	uint32_t m_component_entity_types_words = 0;
 
 	// Array of defined component types.
-	std::vector<Component> m_components;
+	Vector<Component> m_components;
+
+	// Maps component type indices (`mp::type_index`) to their index in `m_components`, or -1.
+	Vector<uint32_t> m_component_index_lookup;
+
+	// Table of `m_entity_types.size()` rows and `m_components.size()` columns, mapping entity
+	// type and component indices to the index of the component range in `m_component_ranges`, or
+	// -1 if the entity type does not have the component. Built by `setup()`.
+	Vector<uint32_t> m_component_range_lookup;
+
+	// Table with the same rows and columns as `m_component_range_lookup`, mapping entity type and
+	// component indices to the entity type that has the same components plus or but (if the
+	// entity type has it) the component, or -1 if there is no such entity type. Built by
+	// `setup()`.
+	Vector<Type> m_entity_type_transitions;
+
+	// Array of the separately stored fields of defined component types.
+	Vector<Component_field> m_component_fields;
 
 	// Array of component ranges in component instances arrays.
-	std::vector<Component_range> m_component_ranges;
+	Vector<Component_range> m_component_ranges;
 
 	// Array of defined entity types.
-	std::vector<Entity_type> m_entity_types;
+	Vector<Entity_type> m_entity_types;
 	
 	// Array of component references from entity types.
-	std::vector<Component_ref> m_component_refs;
+	Vector<Component_ref> m_component_refs;
 
 	// Array of foreach instances.
-	std::vector<Foreach> m_foreaches;
+	Vector<Foreach> m_foreaches;
 
 	// Array of foreach statements referenced by foreach instances.
-	std::vector<Foreach_stmt> m_foreach_stmts;
+	Vector<Foreach_stmt> m_foreach_stmts;
+
+	// Relative frequencies of foreach instances used to lay entity types out, see
+	// `set_foreach_profile()`.
+	Vector<uint64_t> m_foreach_profile;
+
+	// Storage policy the context has been set up with.
+	Storage m_storage = Storage_packed;
+
+	// Alignment in bytes of component range starts the context has been set up with.
+	uint32_t m_range_alignment = 0;
+
+	// Entities queued for destruction by `destroy_deferred()`.
+	Vector<Entity> m_destroy_queue;
+
+	// Systems registered with `add_system()`.
+	Vector<System> m_systems;
+
+	// Indices of the systems in run order, grouped by pass, and the end of each pass in this
+	// array. Both are built by `run_systems()` when empty.
+	Vector<uint32_t> m_system_order;
+	Vector<uint32_t> m_system_pass_ends;
+
+	// Command buffers of the workers, see `command_buffer()`.
+	Vector<Command_buffer> m_command_buffers;
+
+	// Job system set by the user, if any.
+	Job_system* m_job_system = nullptr;
+
+	// Job system used when the user has not set any, created on first use.
+	std::unique_ptr<Thread_pool> m_default_job_system;
+
+	// The change version component ranges are stamped with when modified, incremented by every
+	// access that may modify them.
+	uint64_t m_change_version = 0;
+
+	// Work done by the context, only counted when ENTITY_COUNTERS is defined. Mutable as the
+	// helpers moving instances take the context as const.
+	mutable Counters m_counters = {};
+
+	// Whether a parallel pass is running, during which structural changes are forbidden.
+	bool m_parallel_pass = false;
+
+	// File the component arrays point into since `load()`.
+	Mapped_file m_mapped_file;
+};
+
+// A handle to a component instance of an entity, obtained from `Context::handle()`. A handle
+// caches the location of the instance, so that repeatedly accessing it only costs a version
+// check while no structural change (e.g. creating or destroying entities) has affected the
+// component. After that, the handle transparently looks up the instance again on next access.
+template <typename T>
+class Component_handle
+{
+public:
+	// Returns the entity the handle refers to.
+	Entity entity() const { return m_entity; }
+
+	// Returns the component instance, or nullptr if the entity is not alive or does not have the
+	// component. Marks the range of the instance changed like `Context::get()`.
+	T* get()
+	{
+		if (m_component_index != (uint32_t)-1 && m_context->m_components[m_component_index].version != m_version)
+			resolve();
+		if (m_instance)
+			m_context->mark_accessed(m_context->m_component_range_lookup[m_entity.type * m_context->m_components.size() + m_component_index]);
+		return m_instance;
+	}
+
+	T* operator->() { T* instance = get(); assert(instance); return instance; }
+
+	T& operator*() { T* instance = get(); assert(instance); return *instance; }
+
+	explicit operator bool() { return get() != nullptr; }
+
+private:
+	friend Context;
+
+	// Looks the component instance up and caches its location and the component version.
+	void resolve()
+	{
+		m_instance = nullptr;
+		m_component_index = (uint32_t)-1;
+
+		// Once the entity is dead or known not to have the component, there's nothing to update.
+		if (!m_context->is_alive(m_entity))
+			return;
+
+		auto location = m_context->get_component_instance(m_entity, m_component_type_index);
+		if (!location.component)
+			return;
+
+		m_instance = Component_access<T>::make_array(location.component->array, location.component->array_capacity, location.physical_index);
+		m_component_index = (uint32_t)(location.component - m_context->m_components.data());
+		m_version = location.component->version;
+	}
+
+	// The context the entity belongs to.
+	Context* m_context = nullptr;
+
+	// The entity the component belongs to.
+	Entity m_entity;
+
+	// The type index of T.
+	uint32_t m_component_type_index = 0;
+
+	// Index of component T in the context, -1 if the handle can't be valid anymore.
+	uint32_t m_component_index = (uint32_t)-1;
+
+	// Version of the component at the time the instance was looked up.
+	uint64_t m_version = 0;
+
+	// The cached instance.
+	T* m_instance = nullptr;
 };
 
 // Lightweight class optionally used in entity components foreach iterations to fetch additional
@@ -465,6 +1986,13 @@ public:
 		m_flags |= Entity_destroyed;
 	}
 
+	// Helper function that queues current entity for destruction on the next `Context::flush()`.
+	// Unlike `destroy_entity()` the iteration is not affected.
+	void destroy_entity_deferred()
+	{
+		m_context->destroy_deferred(entity());
+	}
+
 	// Performs a nested foreach starting from the entity after current one.
 	template <typename Fn>
 	void nested_call(Fn fn)
@@ -499,3 +2027,14 @@ private:
 };
 
 } // namespace entity
+
+namespace std {
+
+// Hashes entity ids as their 64 bit value.
+template <>
+struct hash<entity::Entity>
+{
+	size_t operator()(entity::Entity const& entity) const { return hash<uint64_t>()(entity.value()); }
+};
+
+} // namespace std
@@ -0,0 +1,84 @@
+#include "jobs.h"
+#include <algorithm>
+
+namespace entity {
+
+Thread_pool::Thread_pool(uint32_t worker_count)
+	: m_next_job(0)
+{
+	if (!worker_count)
+		worker_count = std::max(std::thread::hardware_concurrency(), 1U);
+
+	for (uint32_t i = 1; i < worker_count; ++i)
+		m_threads.emplace_back(&Thread_pool::worker_main, this, i);
+}
+
+Thread_pool::~Thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+void Thread_pool::run(uint32_t job_count, Job_fn fn, void* data)
+{
+	// Not worth waking up the workers, run the job(s) inline.
+	if (job_count <= 1 || m_threads.empty())
+	{
+		for (uint32_t i = 0; i < job_count; ++i)
+			fn(data, i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fn = fn;
+		m_data = data;
+		m_job_count = job_count;
+		m_next_job = 0;
+		m_active_count = (uint32_t)m_threads.size();
+		++m_run_generation;
+	}
+	m_wake.notify_all();
+
+	execute(0);
+
+	// Wait for all workers to leave the run, so that none of them picks jobs from the next one.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this] { return m_active_count == 0; });
+}
+
+void Thread_pool::worker_main(uint32_t worker_index)
+{
+	uint64_t run_generation = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_quit || m_run_generation != run_generation; });
+			if (m_quit)
+				return;
+			run_generation = m_run_generation;
+		}
+
+		execute(worker_index);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_active_count == 0)
+			m_done.notify_one();
+	}
+}
+
+void Thread_pool::execute(uint32_t worker_index)
+{
+	for (uint32_t job_index; (job_index = m_next_job++) < m_job_count;)
+		m_fn(m_data, job_index, worker_index);
+}
+
+} // namespace entity
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace entity {
+
+// Interface of the job system parallel Context operations run on. Implement this interface to
+// plug the Context into an existing job system, otherwise the Context uses a `Thread_pool`.
+class Job_system
+{
+public:
+	// Signature of a job function. [data] is the pointer provided to `run()`, [job_index] is the
+	// index of the job in [0, job_count) and [worker_index] the index of the worker running it in
+	// [0, worker_count()).
+	using Job_fn = void (*)(void* data, uint32_t job_index, uint32_t worker_index);
+
+	virtual ~Job_system() {}
+
+	// Returns the number of workers jobs can run on, including the thread calling `run()`.
+	virtual uint32_t worker_count() const = 0;
+
+	// Runs [job_count] invocations of [fn] and returns when all of them have completed. Jobs can
+	// be executed in any order and concurrently.
+	virtual void run(uint32_t job_count, Job_fn fn, void* data) = 0;
+};
+
+// Default job system: a pool of threads that, together with the thread calling `run()`, pick
+// jobs from a shared counter.
+class Thread_pool : public Job_system
+{
+public:
+	// Creates a pool with [worker_count] workers including the calling thread. If zero the number
+	// of hardware threads is used.
+	explicit Thread_pool(uint32_t worker_count = 0);
+
+	~Thread_pool();
+
+	uint32_t worker_count() const override { return (uint32_t)m_threads.size() + 1; }
+
+	void run(uint32_t job_count, Job_fn fn, void* data) override;
+
+private:
+	// Entry point of each worker thread.
+	void worker_main(uint32_t worker_index);
+
+	// Executes jobs of current run until none is left.
+	void execute(uint32_t worker_index);
+
+	// Worker threads, the thread calling `run()` is worker 0.
+	std::vector<std::thread> m_threads;
+
+	// Protects the run state below and is used with the condition variables.
+	std::mutex m_mutex;
+
+	// Signaled when a new run is available or the pool is shutting down.
+	std::condition_variable m_wake;
+
+	// Signaled when the last worker leaves the current run.
+	std::condition_variable m_done;
+
+	// Current run job function, data and number of jobs.
+	Job_fn m_fn = nullptr;
+	void* m_data = nullptr;
+	uint32_t m_job_count = 0;
+
+	// Index of the next job to execute in current run.
+	std::atomic<uint32_t> m_next_job;
+
+	// Number of worker threads that have not left current run yet.
+	uint32_t m_active_count = 0;
+
+	// Incremented at each run, used by worker threads to detect new runs.
+	uint64_t m_run_generation = 0;
+
+	// Whether the pool is shutting down.
+	bool m_quit = false;
+};
+
+} // namespace entity
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <algorithm>
 #include <array>
+#include <atomic>
 
 namespace mp {
 
@@ -16,17 +17,57 @@ struct build_indices : build_indices<N - 1, N - 1, Is...> {};
 template <size_t... Is>
 struct build_indices<0, Is...> : indices<Is...> {};
 
+// Returns the 64 bit FNV-1a hash of the null terminated string [s].
+constexpr uint64_t fnv1a(char const* s)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *s; ++s)
+		hash = (hash ^ (uint8_t)*s) * 1099511628211ULL;
+	return hash;
+}
+
+// Returns the hash of the signature of this function as spelled by the compiler, which names
+// type T. It is the same across builds and processes made with the same compiler.
 template <typename T>
-struct type_id
+constexpr uint64_t type_name_hash()
 {
-	static uintptr_t const value;
+#ifdef _MSC_VER
+	return fnv1a(__FUNCSIG__);
+#else
+	return fnv1a(__PRETTY_FUNCTION__);
+#endif
+}
 
-private:
-	static char storage;
+// Stable id of type T, computed at compile time from its name. Specialize it to give a type an
+// explicit id, e.g. to keep data saved with the id valid when the type gets renamed, or to
+// resolve a hash collision.
+template <typename T>
+struct type_id
+{
+	static constexpr uint64_t value = type_name_hash<T>();
 };
 
-template <typename T> char type_id<T>::storage;
-template <typename T> uintptr_t const type_id<T>::value = (uintptr_t)&type_id<T>::storage;
+template <typename T> constexpr uint64_t type_id<T>::value;
+
+// Returns the counter used to assign type indices. Atomic, as the first use of types can happen
+// concurrently, e.g. from parallel jobs or one Context per thread.
+inline std::atomic<uint32_t>& type_index_counter()
+{
+	static std::atomic<uint32_t> counter(0);
+	return counter;
+}
+
+// Dense, zero based, process wide index of type T assigned on first use. Unlike `type_id`, type
+// indices are small integers that can be used to index arrays.
+template <typename T>
+struct type_index
+{
+	static uint32_t value()
+	{
+		static const uint32_t index = type_index_counter().fetch_add(1);
+		return index;
+	}
+};
 
 }
 
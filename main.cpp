@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <ctime>
+#include <unordered_set>
 
 struct Position
 {
@@ -17,6 +18,1386 @@ struct Velocity
 	int y;
 };
 
+// Checks that `create_n()` creates distinct, alive entities of the type, as `create()` does.
+static void test_create_n()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(100);
+	context.create_n(entity_position, 60, es.data());
+	context.create_n(entity_velocity, 20, es.data() + 60);
+	context.create_n(entity_position, 20, es.data() + 80);
+
+	for (int i = 0; i < 100; ++i)
+	{
+		assert(context.is_alive(es[i]));
+		assert(es[i].type == (i >= 60 && i < 80 ? entity_velocity : entity_position));
+		for (int j = 0; j < i; ++j)
+			assert(es[i] != es[j]);
+
+		if (es[i].type == entity_position)
+			context.get<Position>(es[i]) = { i, i * 10 + 2 };
+	}
+
+	int count = 0;
+	context.foreach(foreach_position, [&](Position& p)
+	{
+		assert(p.y == p.x * 10 + 2);
+		++count;
+	});
+	assert(count == 80);
+}
+
+// Checks bulk and deferred destruction, including an entity queued for destruction that is
+// destroyed, and its index reused, before the flush.
+static void test_destroy_n()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(100);
+	context.create_n(entity_position, 100, es.data());
+	for (int i = 0; i < 100; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+
+	std::vector<entity::Entity> destroyed;
+	for (int i = 0; i < 100; i += 2)
+		destroyed.push_back(es[i]);
+	context.destroy_n(destroyed.data(), (uint32_t)destroyed.size());
+
+	for (int i = 0; i < 100; ++i)
+		assert(context.is_alive(es[i]) == (i % 2 == 1));
+
+	context.foreach(foreach_position, [&](Position& p)
+	{
+		assert(p.x % 2 == 1 && p.y == p.x * 10 + 2);
+	});
+
+	// Queued entities stay alive until the flush, queueing twice is allowed.
+	context.destroy_deferred(es[1]);
+	context.destroy_deferred(es[1]);
+	context.destroy_deferred(es[3]);
+	assert(context.is_alive(es[1]));
+	context.flush();
+	assert(!context.is_alive(es[1]) && !context.is_alive(es[3]) && context.is_alive(es[5]));
+
+	// The stale id left in the queue must not destroy the entity reusing its index.
+	context.destroy_deferred(es[5]);
+	context.destroy(es[5]);
+
+	std::vector<entity::Entity> created(100);
+	context.create_n(entity_position, 100, created.data());
+	assert(std::find_if(created.begin(), created.end(), [&](entity::Entity e) { return e.index == es[5].index; }) != created.end());
+
+	context.flush();
+	for (size_t i = 0; i < created.size(); ++i)
+		assert(context.is_alive(created[i]));
+	for (int i = 7; i < 100; i += 2)
+		assert(context.is_alive(es[i]) && context.get<Position>(es[i]).x == i);
+}
+
+// Checks that entities keep their components while the ranges of slack storage move to grow.
+static void test_slack_storage()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup(entity::Storage_slack);
+
+	// Interleaved creations grow the ranges of both entity types one after the other.
+	std::vector<entity::Entity> es;
+	for (int i = 0; i < 1000; ++i)
+	{
+		es.push_back(context.create(i % 2 ? entity_position : entity_position_velocity));
+		context.get<Position>(es.back()) = { i, i * 10 + 2 };
+	}
+
+	for (int i = 0; i < 1000; i += 3)
+		context.destroy(es[i]);
+
+	for (int i = 0; i < 1000; ++i)
+		assert(context.is_alive(es[i]) == (i % 3 != 0) && (i % 3 == 0 || context.get<Position>(es[i]).x == i));
+
+	int count = 0;
+	context.foreach(foreach_position, [&](Position& p)
+	{
+		assert(p.x % 3 != 0 && p.y == p.x * 10 + 2);
+		++count;
+	});
+	assert(count == 666);
+}
+
+// Checks that `parallel_foreach()` visits every instance exactly once on a pool of workers.
+static void test_parallel_foreach()
+{
+	entity::Thread_pool thread_pool(4);
+	entity::Context context;
+	context.set_job_system(&thread_pool);
+
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10000);
+	for (auto type : { entity_position, entity_position_velocity })
+	{
+		context.create_n(type, (uint32_t)es.size(), es.data());
+		for (int i = 0; i < (int)es.size(); ++i)
+			context.get<Position>(es[i]) = { i, 0 };
+	}
+
+	context.parallel_foreach(foreach_position, [](Position& p)
+	{
+		p.y = p.x * 10 + 2;
+	});
+
+	std::atomic<int> count(0);
+	context.parallel_foreach(foreach_position, [&](Position& p)
+	{
+		assert(p.y == p.x * 10 + 2);
+		++count;
+	});
+	assert(count == 20000);
+}
+
+// Checks that `foreach_chunk()` passes contiguous arrays covering every instance once.
+static void test_foreach_chunk()
+{
+	entity::Context context;
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	entity::Foreach<Velocity, Position> foreach_velocity_position;
+	context.define(foreach_velocity_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(300);
+	context.create_n(entity_position_velocity, 200, es.data());
+	context.create_n(entity_velocity, 100, es.data() + 200);
+	for (int i = 0; i < 300; ++i)
+		context.get<Velocity>(es[i]) = { i, i * 123 };
+
+	uint32_t chunks = 0;
+	uint32_t total = 0;
+	context.foreach_chunk(foreach_velocity, [&](uint32_t count, Velocity* v)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			assert(v[i].y == v[i].x * 123);
+		++chunks;
+		total += count;
+	});
+	assert(chunks == 2 && total == 300);
+
+	context.foreach_chunk(foreach_velocity_position, [&](uint32_t count, Velocity* v, Position* p)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			p[i] = { v[i].x, v[i].x * 10 + 2 };
+	});
+
+	for (int i = 0; i < 200; ++i)
+		assert(context.get<Position>(es[i]).x == i && context.get<Position>(es[i]).y == i * 10 + 2);
+}
+
+struct alignas(32) Aligned
+{
+	float f[8];
+};
+
+// Checks that over-aligned components and the [range_alignment] of `setup()` are honored.
+static void test_alignment()
+{
+	entity::Context context;
+	entity::Type entity_aligned_position = context.define<Aligned, Position>();
+	entity::Type entity_aligned = context.define<Aligned>();
+	entity::Type entity_position = context.define<Position>();
+
+	entity::Foreach<Aligned> foreach_aligned;
+	context.define(foreach_aligned);
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup(entity::Storage_packed, 64);
+
+	std::vector<entity::Entity> es(7);
+	context.create_n(entity_position, 3, es.data());
+	context.create_n(entity_aligned_position, 7, es.data());
+	context.create_n(entity_aligned, 5, es.data());
+	context.create_n(entity_position, 1, es.data());
+
+	context.foreach(foreach_aligned, [](Aligned& a)
+	{
+		assert((uintptr_t)&a % alignof(Aligned) == 0);
+	});
+
+	// Each component range starts at a multiple of 64 bytes.
+	uint32_t chunks = 0;
+	context.foreach_chunk(foreach_aligned, [&](uint32_t, Aligned* a)
+	{
+		assert((uintptr_t)a % 64 == 0);
+		++chunks;
+	});
+	context.foreach_chunk(foreach_position, [&](uint32_t, Position* p)
+	{
+		assert((uintptr_t)p % 64 == 0);
+		++chunks;
+	});
+	assert(chunks == 4);
+}
+
+// Component stored as structure of arrays, with padding between and after its fields.
+struct Body
+{
+	double mass;
+	int id;
+	char flags;
+	float radius;
+};
+
+template <> struct entity::Soa_layout<Body> : entity::Soa<double, int, char, float> {};
+
+// Checks that components stored as structure of arrays are loaded, stored and iterated field by
+// field.
+static void test_soa()
+{
+	entity::Context context;
+	entity::Type entity_body = context.define<Body>();
+	entity::Type entity_body_position = context.define<Body, Position>();
+
+	entity::Foreach<Body> foreach_body;
+	context.define(foreach_body);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(100);
+	context.create_n(entity_body, 50, es.data());
+	context.create_n(entity_body_position, 50, es.data() + 50);
+	for (int i = 0; i < 100; ++i)
+		context.get<Body>(es[i]).store({ i * 0.5, i, (char)(i % 2), 0.0f });
+
+	context.foreach(foreach_body, [](entity::Soa_ref<Body> body)
+	{
+		body.get<3>() = body.get<1>() * 2.0f;
+	});
+
+	// Each field is a contiguous array.
+	uint32_t matching = 0;
+	context.foreach_chunk(foreach_body, [&](uint32_t count, entity::Soa_array<Body> bodies)
+	{
+		int const* ids = bodies.field<1>();
+		float const* radiuses = bodies.field<3>();
+		for (uint32_t i = 0; i < count; ++i)
+			matching += radiuses[i] == ids[i] * 2.0f && bodies[i].get<0>() == ids[i] * 0.5;
+	});
+	assert(matching == 100);
+
+	matching = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		Body body = context.get<Body>(es[i]).load();
+		matching += body.mass == i * 0.5 && body.id == i && body.flags == i % 2 && body.radius == i * 2.0f;
+	}
+	assert(matching == 100);
+}
+
+// Component no entity type has.
+struct Unused
+{
+	int u;
+};
+
+// Checks that `try_get()` finds the components an entity has and only those.
+static void test_component_lookup()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Type entity_velocity = context.define<Velocity>();
+	context.setup();
+
+	entity::Entity p = context.create(entity_position);
+	entity::Entity pv = context.create(entity_position_velocity);
+	entity::Entity v = context.create(entity_velocity);
+
+	context.get<Position>(p) = { 1, 12 };
+	context.get<Position>(pv) = { 2, 22 };
+	context.get<Velocity>(pv) = { 3, 369 };
+	context.get<Velocity>(v) = { 4, 492 };
+
+	assert(context.try_get<Position>(p) == &context.get<Position>(p) && context.try_get<Velocity>(p) == nullptr);
+	assert(context.try_get<Position>(pv)->x == 2 && context.try_get<Velocity>(pv)->x == 3);
+	assert(context.try_get<Position>(v) == nullptr && context.try_get<Velocity>(v)->x == 4);
+	assert(context.try_get<Unused>(p) == nullptr);
+}
+
+// Checks that component handles follow their instance across structural changes and become null
+// when their entity is destroyed.
+static void test_component_handles()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	context.setup();
+
+	entity::Entity first = context.create(entity_position_velocity);
+	entity::Entity e = context.create(entity_position_velocity);
+	context.get<Position>(e) = { 1, 12 };
+
+	auto handle = context.handle<Position>(e);
+	assert(handle && handle.entity() == e && handle->x == 1);
+	entity::Entity p = context.create(entity_position);
+	assert(!context.handle<Velocity>(p));
+	(void)p;
+
+	// Growing the other range of the component and destroying an entity of the same type may
+	// move the instance.
+	std::vector<entity::Entity> es(1000);
+	context.create_n(entity_position, 1000, es.data());
+	context.destroy(first);
+	assert(handle->x == 1 && handle->y == 12);
+
+	handle->x = 3;
+	assert(context.get<Position>(e).x == 3);
+
+	context.destroy(e);
+	assert(!handle);
+}
+
+// Checks that foreaches visit all their entities with entity types laid out by a foreach profile,
+// and that `foreach_profile()` counts the entities each foreach iterated over.
+static void test_foreach_profile()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	context.set_foreach_profile({ 1, 100 });
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position, 10, es.data());
+	context.create_n(entity_position_velocity, 5, es.data());
+	context.create_n(entity_velocity, 3, es.data());
+
+	int count = 0;
+	for (int i = 0; i < 2; ++i)
+		context.foreach(foreach_position, [&](Position&) { ++count; });
+	context.foreach(foreach_velocity, [&](Velocity&) { ++count; });
+	assert(count == 38);
+
+	auto profile = context.foreach_profile();
+	assert(profile.size() == 2 && profile[0] == 30 && profile[1] == 8);
+}
+
+// Allocator that counts the blocks allocated through it.
+class Counting_allocator : public entity::Allocator
+{
+public:
+	void* reallocate(void* ptr, size_t size, size_t new_size, size_t alignment) override
+	{
+		live_count += (ptr == nullptr) - (new_size == 0);
+		total_count += ptr == nullptr && new_size;
+		return entity::default_allocator().reallocate(ptr, size, new_size, alignment);
+	}
+
+	int live_count = 0;
+	int total_count = 0;
+};
+
+// Checks that contexts make all their allocations with their allocator, and can be backed by an
+// arena reused from one context to the next.
+static void test_allocators()
+{
+	Counting_allocator counting_allocator;
+	{
+		entity::Context context(counting_allocator);
+		entity::Type entity_position = context.define<Position>();
+		context.setup();
+
+		std::vector<entity::Entity> es(1000);
+		context.create_n(entity_position, 1000, es.data());
+		context.destroy_n(es.data(), 500);
+	}
+	assert(counting_allocator.total_count > 0 && counting_allocator.live_count == 0);
+
+	entity::Arena_allocator arena(1 << 16);
+	for (int round = 0; round < 3; ++round)
+	{
+		{
+			entity::Context context(arena);
+			entity::Type entity_position = context.define<Position>();
+			entity::Type entity_aligned = context.define<Aligned, Position>();
+
+			entity::Foreach<Position> foreach_position;
+			context.define(foreach_position);
+
+			context.setup();
+
+			std::vector<entity::Entity> es(1000);
+			context.create_n(entity_position, 1000, es.data());
+			context.create_n(entity_aligned, 100, es.data());
+			for (int i = 0; i < 100; ++i)
+			{
+				context.get<Position>(es[i]) = { i, i * 10 + 2 };
+				assert((uintptr_t)&context.get<Aligned>(es[i]) % alignof(Aligned) == 0);
+			}
+
+			context.foreach(foreach_position, [&](Position& p)
+			{
+				assert(p.y == p.x * 10 + 2 || (p.x == 0 && p.y == 0));
+			});
+		}
+		arena.reset();
+	}
+}
+
+// Checks that creating entities within a reservation moves no instance, and that
+// `shrink_to_fit()` keeps the instances and the reservations.
+static void test_reserve()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>(100);
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	context.reserve(entity_position_velocity, 50);
+	context.setup();
+
+	entity::Entity first = context.create(entity_position);
+	entity::Entity first_velocity = context.create(entity_position_velocity);
+	Position* instance = &context.get<Position>(first);
+	Velocity* velocity_instance = &context.get<Velocity>(first_velocity);
+
+	std::vector<entity::Entity> es(150);
+	context.create_n(entity_position, 99, es.data());
+	context.create_n(entity_position_velocity, 49, es.data() + 99);
+	assert(&context.get<Position>(first) == instance && &context.get<Velocity>(first_velocity) == velocity_instance);
+	(void)velocity_instance;
+
+	for (int i = 0; i < 148; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+
+	context.destroy_n(es.data(), 90);
+	context.shrink_to_fit();
+	for (int i = 90; i < 148; ++i)
+		assert(context.get<Position>(es[i]).x == i && context.get<Position>(es[i]).y == i * 10 + 2);
+
+	// The reservation is kept.
+	instance = &context.get<Position>(first);
+	context.create_n(entity_position, 90, es.data());
+	assert(&context.get<Position>(first) == instance);
+	(void)instance;
+}
+
+// Checks that destroyed entity indices are reused with a new generation, so that stale ids are not
+// alive, including after `clear()`.
+static void test_free_list()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	context.setup();
+
+	std::vector<entity::Entity> es(11);
+	context.create_n(entity_position, 10, es.data());
+	context.destroy(es[3]);
+	context.destroy(es[7]);
+
+	std::vector<entity::Entity> created;
+	created.push_back(context.create(entity_position));
+	created.push_back(context.create(entity_position));
+	assert(created[0].index + created[1].index == es[3].index + es[7].index && (created[0].index == es[3].index || created[0].index == es[7].index));
+	assert(!context.is_alive(es[3]) && !context.is_alive(es[7]) && context.is_alive(created[0]) && context.is_alive(created[1]));
+
+	// New indices are only used once the free ones are exhausted.
+	created.push_back(context.create(entity_position));
+	assert(created[2].index == 10);
+
+	context.clear();
+	context.create_n(entity_position, 11, es.data());
+	for (int i = 0; i < 3; ++i)
+		assert(!context.is_alive(created[i]));
+	for (int i = 0; i < 11; ++i)
+		assert(context.is_alive(es[i]) && es[i].index < 11);
+}
+
+// Checks that entity ids round trip through their 64 bit value and hash, and that reusing an
+// index many times never makes a stale id alive.
+static void test_entity_ids()
+{
+	entity::Context context;
+	context.define<Position>();
+	entity::Type entity_velocity = context.define<Velocity>();
+	context.setup();
+
+	std::unordered_set<entity::Entity> ids;
+	entity::Entity previous;
+	for (int i = 0; i < 1000; ++i)
+	{
+		entity::Entity e = context.create(entity_velocity);
+		assert(entity::Entity::from_value(e.value()) == e && e.type == entity_velocity);
+		assert(e.index == 0 && !context.is_alive(previous));
+		ids.insert(e);
+
+		context.destroy(e);
+		previous = e;
+	}
+	assert(ids.size() == 1000);
+}
+
+// Checks that adding and removing components moves entities between entity types, keeping the
+// instances of the components both types have.
+static void test_migration()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Type entity_velocity = context.define<Velocity>();
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position, 10, es.data());
+	for (int i = 0; i < 10; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+
+	entity::Entity e = es[4];
+	context.add_component<Velocity>(e);
+	assert(e.type == entity_position_velocity && !context.is_alive(es[4]) && context.is_alive(e));
+	assert(context.get<Position>(e).x == 4 && context.get<Position>(e).y == 42);
+	assert(context.get<Velocity>(e).x == 0 && context.get<Velocity>(e).y == 0);
+
+	context.get<Velocity>(e) = { 5, 615 };
+	entity::Entity moved = e;
+	context.remove_component<Position>(e);
+	assert(e.type == entity_velocity && !context.is_alive(moved));
+	assert(context.get<Velocity>(e).x == 5 && context.try_get<Position>(e) == nullptr);
+
+	for (int i = 0; i < 10; ++i)
+		assert(i == 4 || context.get<Position>(es[i]).x == i);
+
+	(void)entity_position_velocity;
+	(void)entity_velocity;
+	(void)moved;
+}
+
+// Checks that entity types and foreaches defined after `setup()` work with the existing ones,
+// without moving existing instances.
+static void test_define_after_setup()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position, 10, es.data());
+	for (int i = 0; i < 10; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+
+	// The new entity type is matched by the existing foreach.
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Entity e = context.create(entity_position_velocity);
+	context.get<Position>(e) = { 10, 102 };
+	context.get<Velocity>(e) = { 1, 123 };
+
+	int count = 0;
+	context.foreach(foreach_position, [&](Position& p)
+	{
+		assert(p.y == p.x * 10 + 2);
+		++count;
+	});
+	assert(count == 11);
+
+	// Migrations reach entity types defined after setup in both directions.
+	entity::Entity migrated = es[0];
+	context.add_component<Velocity>(migrated);
+	assert(migrated.type == entity_position_velocity && context.get<Position>(migrated).y == 2);
+
+	entity::Type entity_velocity = context.define<Velocity>();
+	context.remove_component<Position>(e);
+	assert(e.type == entity_velocity && context.get<Velocity>(e).y == 123);
+	(void)entity_velocity;
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	count = 0;
+	context.foreach(foreach_velocity, [&](Velocity&) { ++count; });
+	assert(count == 2);
+
+	for (int i = 1; i < 10; ++i)
+		assert(context.get<Position>(es[i]).x == i);
+
+	// Entity types defined after setup start after the reservations of the existing ones.
+	entity::Context reserved_context;
+	entity::Type entity_reserved = reserved_context.define<Position>();
+	reserved_context.setup();
+	reserved_context.reserve(entity_reserved, 1000);
+
+	std::vector<entity::Entity> reserved(1000);
+	reserved_context.create_n(entity_reserved, 10, reserved.data());
+
+	entity::Type entity_late = reserved_context.define<Position, Velocity>();
+	std::vector<entity::Entity> late(100);
+	reserved_context.create_n(entity_late, 100, late.data());
+	std::vector<Position*> late_positions(100);
+	for (int i = 0; i < 100; ++i)
+		late_positions[i] = &reserved_context.get<Position>(late[i]);
+
+	reserved_context.create_n(entity_reserved, 990, reserved.data() + 10);
+	for (int i = 0; i < 100; ++i)
+		assert(&reserved_context.get<Position>(late[i]) == late_positions[i]);
+}
+
+// Checks that `Without` skips the entity types having the component and that `Optional` passes
+// null for the entity types not having it.
+static void test_filtered_foreach()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position, entity::Without<Velocity>> foreach_position_only;
+	context.define(foreach_position_only);
+
+	entity::Foreach<Position, entity::Optional<Velocity>> foreach_position_optional_velocity;
+	context.define(foreach_position_optional_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(30);
+	context.create_n(entity_position, 10, es.data());
+	context.create_n(entity_position_velocity, 20, es.data() + 10);
+	for (int i = 0; i < 30; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+	for (int i = 10; i < 30; ++i)
+		context.get<Velocity>(es[i]) = { i, i * 123 };
+
+	int count = 0;
+	context.foreach(foreach_position_only, [&](Position& p)
+	{
+		assert(p.x < 10);
+		++count;
+	});
+	assert(count == 10);
+
+	count = 0;
+	int with_velocity = 0;
+	context.foreach(foreach_position_optional_velocity, [&](Position& p, Velocity* v)
+	{
+		assert(v ? p.x >= 10 && v->x == p.x : p.x < 10);
+		with_velocity += v != nullptr;
+		++count;
+	});
+	assert(count == 30 && with_velocity == 20);
+}
+
+// Checks that `foreach_changed_since()` only visits the entity types whose instances of its
+// components may have been modified after the given version.
+static void test_change_tracking()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position, 10, es.data());
+	context.create_n(entity_position_velocity, 10, es.data());
+	context.create_n(entity_velocity, 10, es.data());
+
+	int count = 0;
+	uint64_t version = context.change_version();
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	assert(count == 0);
+
+	// Writing positions leaves the velocities unchanged.
+	context.foreach(foreach_position, [](Position& p) { p.x = 1; });
+	context.foreach_changed_since(foreach_position, version, [&](Position&) { ++count; });
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	assert(count == 20);
+
+	// Creating an entity changes the ranges of its entity type.
+	count = 0;
+	version = context.change_version();
+	context.create(entity_velocity);
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	context.foreach_changed_since(foreach_position, version, [&](Position&) { ++count; });
+	assert(count == 11);
+
+#ifdef ENTITY_CHANGE_TRACKING
+	count = 0;
+	version = context.change_version();
+	context.get<Velocity>(es[0]).x = 2;
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	context.foreach_changed_since(foreach_position, version, [&](Position&) { ++count; });
+	assert(count == 11);
+
+	entity::Entity positioned = context.create(entity_position);
+	count = 0;
+	version = context.change_version();
+	context.try_get<Position>(positioned)->x = 2;
+	context.foreach_changed_since(foreach_position, version, [&](Position&) { ++count; });
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	assert(count == 11);
+
+	auto handle = context.handle<Velocity>(es[0]);
+	count = 0;
+	version = context.change_version();
+	handle->x = 3;
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	context.foreach_changed_since(foreach_position, version, [&](Position&) { ++count; });
+	assert(count == 11);
+#endif
+}
+
+// Checks that components listed as const are not considered modified by the foreach, unlike the
+// ones it writes.
+static void test_read_only_foreach()
+{
+	entity::Context context;
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<const Velocity, Position> foreach_velocity_position;
+	context.define(foreach_velocity_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position_velocity, 10, es.data());
+	for (int i = 0; i < 10; ++i)
+		context.get<Velocity>(es[i]) = { i, i * 123 };
+
+	const uint64_t version = context.change_version();
+	context.foreach(foreach_velocity_position, [](Velocity const& v, Position& p)
+	{
+		p = { v.x, v.x * 10 + 2 };
+	});
+
+	int count = 0;
+	context.foreach_changed_since(foreach_velocity, version, [&](Velocity&) { ++count; });
+	assert(count == 0);
+	context.foreach_changed_since(foreach_position, version, [&](Position& p)
+	{
+		assert(p.y == p.x * 10 + 2);
+		++count;
+	});
+	assert(count == 10);
+}
+
+// Checks that `run_systems()` runs each system over all its entities and runs systems that
+// conflict in registration order.
+static void test_systems()
+{
+	entity::Thread_pool thread_pool(4);
+	entity::Context context;
+	context.set_job_system(&thread_pool);
+
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	entity::Foreach<const Velocity, Position> foreach_velocity_position;
+	context.define(foreach_velocity_position);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(2000);
+	context.create_n(entity_position, 1000, es.data());
+	context.create_n(entity_position_velocity, 1000, es.data() + 1000);
+	for (int i = 0; i < 2000; ++i)
+		context.get<Position>(es[i]) = { i, 0 };
+	for (int i = 1000; i < 2000; ++i)
+		context.get<Velocity>(es[i]) = { i, 0 };
+
+	// The first two systems do not conflict, the third one conflicts with both.
+	context.add_system(foreach_position, [](Position& p) { p.x += 1; });
+	context.add_system(foreach_velocity, [](Velocity& v) { v.x += 2; });
+	context.add_system(foreach_velocity_position, [](Velocity const& v, Position& p) { p.y = p.x + v.x; });
+
+	for (int round = 1; round <= 2; ++round)
+	{
+		context.run_systems();
+		for (int i = 0; i < 2000; ++i)
+		{
+			auto& p = context.get<Position>(es[i]);
+			assert(p.x == i + round && p.y == (i < 1000 ? 0 : p.x + i + 2 * round));
+			(void)p;
+		}
+	}
+}
+
+// Checks that `playback()` applies the creations, writes and destructions recorded from a parallel
+// foreach, ignoring destructions of entities that are not alive anymore.
+static void test_command_buffers()
+{
+	entity::Thread_pool thread_pool(4);
+	entity::Context context;
+	context.set_job_system(&thread_pool);
+
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(1000);
+	context.create_n(entity_position, 1000, es.data());
+	for (int i = 0; i < 1000; ++i)
+		context.get<Position>(es[i]) = { i, 0 };
+
+	context.parallel_foreach(foreach_position, [&](Position& p)
+	{
+		auto& command_buffer = context.command_buffer();
+		auto created = command_buffer.create(entity_velocity);
+		command_buffer.set(created, Velocity{ p.x, p.x * 123 });
+		if (p.x % 2 == 0)
+		{
+			command_buffer.destroy(es[p.x]);
+			command_buffer.destroy(es[p.x]);
+		}
+	});
+
+	// Nothing is applied until playback.
+	assert(context.is_alive(es[0]));
+	int count = 0;
+	context.foreach(foreach_velocity, [&](Velocity&) { ++count; });
+	assert(count == 0);
+
+	context.playback();
+	assert(context.command_buffer().empty());
+
+	std::vector<bool> seen(1000);
+	context.foreach(foreach_velocity, [&](Velocity& v)
+	{
+		assert(v.y == v.x * 123 && !seen[v.x]);
+		seen[v.x] = true;
+		++count;
+	});
+	assert(count == 1000);
+	for (int i = 0; i < 1000; ++i)
+		assert(context.is_alive(es[i]) == (i % 2 != 0));
+
+	context.command_buffer().destroy(es[0]);
+	context.command_buffer().set(es[1], Position{ 1, 12 });
+	context.playback();
+	assert(context.get<Position>(es[1]).y == 12);
+}
+
+// Checks that `restore()` returns to the state of a full or delta image taken by `snapshot()`, and
+// rejects images it cannot restore.
+static void test_snapshot()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(200);
+	context.create_n(entity_position, 100, es.data());
+	context.create_n(entity_position_velocity, 100, es.data() + 100);
+	for (int i = 0; i < 200; ++i)
+		context.get<Position>(es[i]) = { i, i * 10 + 2 };
+
+	std::vector<char> base;
+	context.snapshot(base);
+
+	auto check_base = [&]
+	{
+		for (int i = 0; i < 200; ++i)
+			assert(context.is_alive(es[i]) && context.get<Position>(es[i]).y == i * 10 + 2);
+	};
+
+	context.foreach(foreach_position, [](Position& p) { p.y = 0; });
+	context.destroy_n(es.data(), 50);
+	context.create(entity_position);
+	bool restored = context.restore(base.data(), base.size());
+	assert(restored);
+	check_base();
+
+	// A delta since the base only holds the velocities, written after it was restored. Restored
+	// again, as `get()` counts as a write when ENTITY_CHANGE_TRACKING is defined.
+	restored = context.restore(base.data(), base.size());
+	assert(restored);
+	const uint64_t version = context.change_version();
+	context.foreach(foreach_velocity, [](Velocity& v) { v = { 1, 123 }; });
+	std::vector<char> delta;
+	context.snapshot(delta, version);
+	assert(delta.size() < base.size());
+
+	restored = context.restore(base.data(), base.size()) && context.restore(delta.data(), delta.size());
+	assert(restored);
+	check_base();
+	int count = 0;
+	context.foreach(foreach_velocity, [&](Velocity& v)
+	{
+		assert(v.x == 1 && v.y == 123);
+		++count;
+	});
+	assert(count == 100);
+
+	restored = context.restore(base.data(), base.size() / 2);
+	assert(!restored);
+	check_base();
+
+	// A delta since the base restores the emptied context cleared after it.
+	restored = context.restore(base.data(), base.size());
+	assert(restored);
+	const uint64_t clear_version = context.change_version();
+	context.clear();
+	context.snapshot(delta, clear_version);
+	restored = context.restore(base.data(), base.size()) && context.restore(delta.data(), delta.size());
+	assert(restored);
+	count = 0;
+	context.foreach(foreach_position, [&](Position&) { ++count; });
+	assert(count == 0 && !context.is_alive(es[0]));
+	(void)restored;
+}
+
+// Checks that `load()` maps the world written by `save()`, that the context stays writable once
+// loaded, and that a context with different definitions refuses the file.
+static void test_save_load()
+{
+	const char* path = "test_save_load.world";
+
+	{
+		entity::Context context;
+		entity::Type entity_position = context.define<Position>();
+		entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+		entity::Foreach<Position> foreach_position;
+		context.define(foreach_position);
+
+		context.setup();
+
+		std::vector<entity::Entity> es(2000);
+		context.create_n(entity_position, 1000, es.data());
+		context.create_n(entity_position_velocity, 1000, es.data() + 1000);
+		for (int i = 0; i < 2000; ++i)
+			context.get<Position>(es[i]) = { i, i * 10 + 2 };
+		bool saved = context.save(path);
+		assert(saved);
+		(void)saved;
+
+		context.foreach(foreach_position, [](Position& p) { p.y = 0; });
+		context.destroy_n(es.data(), 500);
+		bool loaded = context.load(path);
+		assert(loaded);
+		(void)loaded;
+
+		for (int i = 0; i < 2000; ++i)
+			assert(context.is_alive(es[i]) && context.get<Position>(es[i]).y == i * 10 + 2);
+
+		// Writes and structural changes work on the mapped arrays.
+		context.get<Position>(es[0]).y = 12;
+		std::vector<entity::Entity> more(5000);
+		context.create_n(entity_position, 5000, more.data());
+		context.destroy(es[1]);
+		assert(context.get<Position>(es[0]).y == 12 && context.get<Position>(es[2]).y == 22);
+
+		int count = 0;
+		context.foreach(foreach_position, [&](Position&) { ++count; });
+		assert(count == 6999);
+	}
+
+	{
+		entity::Context context;
+		context.define<Velocity>();
+		context.setup();
+		bool loaded = context.load(path);
+		assert(!loaded);
+		(void)loaded;
+	}
+
+	remove(path);
+}
+
+struct Health
+{
+	int points;
+};
+
+// Gives Health an explicit id, as data saved before a rename of the type would.
+namespace mp {
+
+template <>
+struct type_id<Health>
+{
+	static constexpr uint64_t value = 0x4865616c7468ULL;
+};
+
+constexpr uint64_t type_id<Health>::value;
+
+}
+
+// Checks that component type ids are compile time constants, distinct per type, and that explicit
+// ids are used to identify components.
+static void test_type_ids()
+{
+	static_assert(mp::type_id<Position>::value != mp::type_id<Velocity>::value, "Component type ids must differ.");
+	static_assert(mp::type_id<Position>::value == mp::type_name_hash<Position>(), "Component type ids must be the hash of the type name.");
+	static_assert(mp::type_id<Health>::value == 0x4865616c7468ULL, "Explicit component type ids must be used.");
+
+	entity::Context context;
+	entity::Type entity_position_health = context.define<Position, Health>();
+	assert((context.define<Health, Position>() == entity_position_health));
+
+	entity::Foreach<Health> foreach_health;
+	context.define(foreach_health);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	context.create_n(entity_position_health, 10, es.data());
+	for (int i = 0; i < 10; ++i)
+		context.get<Health>(es[i]).points = i;
+
+	int sum = 0;
+	context.foreach(foreach_health, [&](Health& h) { sum += h.points; });
+	assert(sum == 45);
+}
+
+template <int N>
+struct Tag
+{
+	int value;
+};
+
+// Checks that entity types with many components and overlapping component sets are told apart
+// whatever the order components are listed in, and that foreaches match all the entity types
+// that have their components.
+static void test_definition_lookup()
+{
+	entity::Context context;
+
+	std::vector<entity::Type> types;
+	types.push_back(context.define<Position>());
+	types.push_back(context.define<Position, Tag<0>>());
+	types.push_back(context.define<Position, Tag<1>>());
+	types.push_back(context.define<Position, Tag<0>, Tag<1>>());
+	types.push_back(context.define<Position, Tag<2>>());
+	types.push_back(context.define<Position, Tag<0>, Tag<2>>());
+	types.push_back(context.define<Position, Tag<1>, Tag<2>>());
+	types.push_back(context.define<Position, Tag<0>, Tag<1>, Tag<2>>());
+
+	std::unordered_set<entity::Type> distinct(types.begin(), types.end());
+	assert(distinct.size() == types.size());
+	assert((context.define<Tag<1>, Position>() == types[2]));
+	assert((context.define<Tag<2>, Tag<1>, Tag<0>, Position>() == types[7]));
+	assert((context.define<Tag<2>, Position, Tag<0>>() == types[5]));
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Tag<0>, Tag<2>> foreach_tag_0_2;
+	context.define(foreach_tag_0_2);
+
+	entity::Foreach<Tag<1>, Position> foreach_tag_1;
+	context.define(foreach_tag_1);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10);
+	for (auto type : types)
+		context.create_n(type, 10, es.data());
+
+	int count = 0;
+	context.foreach(foreach_position, [&](Position&) { ++count; });
+	assert(count == 80);
+
+	count = 0;
+	context.foreach(foreach_tag_0_2, [&](Tag<0>&, Tag<2>&) { ++count; });
+	assert(count == 20);
+
+	count = 0;
+	context.foreach(foreach_tag_1, [&](Tag<1>&, Position&) { ++count; });
+	assert(count == 40);
+}
+
+// Checks that `sort()` orders foreaches by key, moves all components of the entities together and
+// keeps entity ids valid, with both sort methods.
+static void test_sort()
+{
+	entity::Context context;
+	entity::Type entity_position_velocity = context.define<Position, Velocity>();
+
+	entity::Foreach<Position, Velocity> foreach_position_velocity;
+	context.define(foreach_position_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(1000);
+	context.create_n(entity_position_velocity, 1000, es.data());
+	for (int i = 0; i < 1000; ++i)
+	{
+		context.get<Position>(es[i]) = { i * 7919 % 1000, i };
+		context.get<Velocity>(es[i]) = { i, 0 };
+	}
+
+	auto check_sorted = [&]
+	{
+		int previous = -1;
+		context.foreach(foreach_position_velocity, [&](Position& p, Velocity& v)
+		{
+			assert(p.x >= previous && p.y == v.x);
+			previous = p.x;
+		});
+		for (int i = 0; i < 1000; ++i)
+			assert(context.get<Velocity>(es[i]).x == i);
+	};
+
+	context.sort<Position>(entity_position_velocity, [](Position const& p) { return p.x; });
+	check_sorted();
+
+	// Moving a few entities leaves most of them in order.
+	for (int i = 0; i < 1000; i += 100)
+		context.get<Position>(es[i]).x = 999 - context.get<Position>(es[i]).x;
+	context.sort<Position>(entity_position_velocity, [](Position const& p) { return p.x; }, entity::Sort_incremental);
+	check_sorted();
+}
+
+// Checks that entity types with different shared instances are distinct, and that foreaches and
+// `get_shared()` access the one instance of each entity type.
+static void test_shared_components()
+{
+	entity::Context context;
+	entity::Type entity_slow = context.define_shared<Position>(Velocity{ 1, 0 });
+	entity::Type entity_fast = context.define_shared<Position>(Velocity{ 2, 0 });
+	assert(entity_slow != entity_fast);
+	assert(context.define_shared<Position>(Velocity{ 1, 0 }) == entity_slow);
+	assert(context.define<Position>() != entity_slow);
+
+	entity::Foreach<Position, entity::Shared<const Velocity>> foreach_position_velocity;
+	context.define(foreach_position_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(20);
+	context.create_n(entity_slow, 10, es.data());
+	context.create_n(entity_fast, 10, es.data() + 10);
+	for (int i = 0; i < 20; ++i)
+		context.get<Position>(es[i]) = { 0, i };
+
+	context.get_shared<Velocity>(entity_fast).x = 3;
+	context.foreach(foreach_position_velocity, [](Position& p, Velocity const& v) { p.x += v.x; });
+	for (int i = 0; i < 20; ++i)
+		assert(context.get<Position>(es[i]).x == (i < 10 ? 1 : 3));
+	assert(context.get_shared<Velocity>(entity_slow).x == 1);
+}
+
+// Checks that `foreach_hierarchy()` visits parents before their children whatever the creation
+// order, and that destroying a parent detaches its children.
+static void test_hierarchy()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	context.setup();
+
+	// Each entity is the parent of the one created before it, the last one is the root.
+	std::vector<entity::Entity> es(100);
+	context.create_n(entity_position, 100, es.data());
+	for (int i = 0; i < 100; ++i)
+		context.get<Position>(es[i]) = { 1, 0 };
+	for (int i = 0; i < 99; ++i)
+		context.set_parent(es[i], es[i + 1]);
+	assert(context.get_parent(es[0]) == es[1] && context.get_parent(es[99]).is_null());
+
+	auto propagate = [&]
+	{
+		context.foreach_hierarchy(foreach_position, [](Position const* parent, Position& p)
+		{
+			p.y = (parent ? parent->y : 0) + p.x;
+		});
+	};
+
+	propagate();
+	for (int i = 0; i < 100; ++i)
+		assert(context.get<Position>(es[i]).y == 100 - i);
+
+	context.destroy(es[50]);
+	assert(context.get_parent(es[49]).is_null());
+	propagate();
+	for (int i = 0; i < 100; ++i)
+		assert(i == 50 || context.get<Position>(es[i]).y == (i < 50 ? 50 - i : 100 - i));
+
+	context.set_parent(es[0], entity::Entity());
+	propagate();
+	assert(context.get<Position>(es[0]).y == 1 && context.get<Position>(es[1]).y == 49);
+}
+
+// Checks that `insert_entities()` recreates in another context the entities `extract_entities()`
+// extracted, with their components, shared values and parent links, and rejects blobs of entity
+// types the context does not define.
+static void test_extract_insert()
+{
+	entity::Context source;
+	entity::Type source_position_velocity = source.define<Position, Velocity>();
+	entity::Type source_fast = source.define_shared<Position>(Velocity{ 2, 0 });
+	source.setup();
+
+	std::vector<entity::Entity> es(20);
+	source.create_n(source_position_velocity, 10, es.data());
+	source.create_n(source_fast, 10, es.data() + 10);
+	for (int i = 0; i < 20; ++i)
+		source.get<Position>(es[i]) = { i, i * 10 + 2 };
+	for (int i = 0; i < 10; ++i)
+		source.get<Velocity>(es[i]) = { i, i * 123 };
+	source.set_parent(es[11], es[10]);
+	source.set_parent(es[2], es[0]);
+
+	// es[0] is not extracted, so es[2] loses its parent.
+	std::vector<char> blob;
+	source.extract_entities(es.data() + 1, 19, blob);
+
+	entity::Context destination;
+	entity::Type destination_fast = destination.define_shared<Position>(Velocity{ 2, 0 });
+	destination.define<Position, Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	destination.define(foreach_position);
+
+	destination.setup();
+
+	std::vector<entity::Entity> inserted, extracted;
+	bool inserted_all = destination.insert_entities(blob.data(), blob.size(), inserted, &extracted);
+	assert(inserted_all);
+	assert(inserted.size() == 19 && extracted.size() == 19);
+	for (size_t i = 0; i < inserted.size(); ++i)
+	{
+		const int index = (int)(std::find(es.begin(), es.end(), extracted[i]) - es.begin());
+		auto& p = destination.get<Position>(inserted[i]);
+		assert(index >= 1 && index < 20 && p.x == index && p.y == index * 10 + 2);
+		(void)p;
+		if (index < 10)
+			assert(destination.get<Velocity>(inserted[i]).y == index * 123);
+		else
+			assert(destination.try_get<Velocity>(inserted[i]) == nullptr);
+
+		if (index == 11)
+			assert(extracted[std::find(inserted.begin(), inserted.end(), destination.get_parent(inserted[i])) - inserted.begin()] == es[10]);
+		else
+			assert(destination.get_parent(inserted[i]).is_null());
+	}
+	assert(destination.get_shared<Velocity>(destination_fast).x == 2);
+	(void)destination_fast;
+
+	int count = 0;
+	destination.foreach(foreach_position, [&](Position&) { ++count; });
+	assert(count == 19);
+
+	entity::Context other;
+	other.define<Position>();
+	other.setup();
+	inserted.clear();
+	inserted_all = other.insert_entities(blob.data(), blob.size(), inserted);
+	assert(!inserted_all && inserted.empty());
+	(void)inserted_all;
+}
+
+// Checks that counters and foreach times stay zero unless ENTITY_COUNTERS is defined, count the
+// work done otherwise, and are reset by `reset_counters()`.
+static void test_counters()
+{
+	entity::Context context;
+	entity::Type entity_position = context.define<Position>();
+	entity::Type entity_velocity = context.define<Velocity>();
+
+	entity::Foreach<Position> foreach_position;
+	context.define(foreach_position);
+
+	entity::Foreach<Velocity> foreach_velocity;
+	context.define(foreach_velocity);
+
+	context.setup();
+
+	std::vector<entity::Entity> es(10000);
+	context.create_n(entity_position, 10000, es.data());
+	context.create_n(entity_velocity, 10000, es.data());
+	context.foreach(foreach_position, [](Position& p) { p.x = 1; });
+
+	auto& counters = context.counters();
+	auto foreach_times = context.foreach_times();
+	assert(foreach_times.size() == 2);
+#ifdef ENTITY_COUNTERS
+	assert(counters.reallocations > 0 && counters.copied_bytes > 0);
+#else
+	assert(counters.range_shifts == 0 && counters.shifted_instances == 0 && counters.reallocations == 0 && counters.copied_bytes == 0);
+	assert(foreach_times[0] == 0 && foreach_times[1] == 0);
+#endif
+
+	context.reset_counters();
+	foreach_times = context.foreach_times();
+	assert(counters.range_shifts == 0 && counters.shifted_instances == 0 && counters.reallocations == 0 && counters.copied_bytes == 0);
+	assert(foreach_times[0] == 0 && foreach_times[1] == 0);
+	(void)counters;
+}
+
 int main()
 {
 	entity::Context context;
@@ -132,4 +1513,35 @@ int main()
 			printf("p (%d %d) v (%d %d)\n", p.x, p.y, v.x, v.y);
 		});
 	}
+
+	test_create_n();
+	test_destroy_n();
+	test_slack_storage();
+	test_parallel_foreach();
+	test_foreach_chunk();
+	test_alignment();
+	test_soa();
+	test_component_lookup();
+	test_component_handles();
+	test_foreach_profile();
+	test_allocators();
+	test_reserve();
+	test_free_list();
+	test_entity_ids();
+	test_migration();
+	test_define_after_setup();
+	test_filtered_foreach();
+	test_change_tracking();
+	test_read_only_foreach();
+	test_systems();
+	test_command_buffers();
+	test_snapshot();
+	test_save_load();
+	test_type_ids();
+	test_definition_lookup();
+	test_sort();
+	test_shared_components();
+	test_hierarchy();
+	test_extract_insert();
+	test_counters();
 }
@@ -0,0 +1,99 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace entity {
+
+Mapped_file::~Mapped_file()
+{
+	close();
+}
+
+Mapped_file::Mapped_file(Mapped_file&& other)
+	: m_data(other.m_data)
+	, m_size(other.m_size)
+{
+	other.m_data = nullptr;
+	other.m_size = 0;
+}
+
+Mapped_file& Mapped_file::operator=(Mapped_file&& other)
+{
+	if (this != &other)
+	{
+		close();
+		m_data = other.m_data;
+		m_size = other.m_size;
+		other.m_data = nullptr;
+		other.m_size = 0;
+	}
+	return *this;
+}
+
+bool Mapped_file::open(char const* path)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+
+	// The view keeps the file mapped once the handles are closed.
+	if (mapping)
+	{
+		m_data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+		m_size = m_data ? (size_t)size.QuadPart : 0;
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	int file = ::open(path, O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat status;
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+	{
+		void* data = mmap(nullptr, (size_t)status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED)
+		{
+			m_data = static_cast<char*>(data);
+			m_size = (size_t)status.st_size;
+		}
+	}
+	::close(file);
+#endif
+
+	return m_data != nullptr;
+}
+
+void Mapped_file::close()
+{
+	if (!m_data)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+#else
+	munmap(m_data, m_size);
+#endif
+
+	m_data = nullptr;
+	m_size = 0;
+}
+
+} // namespace entity
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace entity {
+
+// A file mapped in memory copy-on-write: the mapping can be written to, without the writes ever
+// reaching the file, and pages are only copied when first written.
+class Mapped_file
+{
+public:
+	Mapped_file() {}
+
+	~Mapped_file();
+
+	Mapped_file(Mapped_file&& other);
+	Mapped_file& operator=(Mapped_file&& other);
+
+	Mapped_file(Mapped_file const&) = delete;
+	Mapped_file& operator=(Mapped_file const&) = delete;
+
+	// Maps the whole file at [path], unmapping the previous one. Returns false if the file cannot
+	// be mapped.
+	bool open(char const* path);
+
+	// Unmaps the file, if any.
+	void close();
+
+	// Returns the start of the mapping, aligned to the page size, or null if no file is mapped.
+	char* data() const { return m_data; }
+
+	// Returns the size in bytes of the mapped file.
+	size_t size() const { return m_size; }
+
+private:
+	char* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+} // namespace entity
@@ -1,11 +1,34 @@
 solution "EC"
 	language "C++"
-	configurations { "Debug" }
+	configurations { "Debug", "Release" }
 	
 	configuration "Debug"
 		optimize "Off"
 		flags "Symbols"
 
+	configuration "Release"
+		optimize "Speed"
+		defines "NDEBUG"
+
+	configuration "linux"
+		links "pthread"
+
 	project "EC"
 		kind "ConsoleApp"
 		files { "**.h", "**.cpp" }
+		removefiles { "bench/**" }
+
+	-- The tests again, with writes through `get()`, `try_get()` and component handles tracked.
+	project "EC_change_tracking"
+		kind "ConsoleApp"
+		files { "**.h", "**.cpp" }
+		removefiles { "bench/**" }
+		defines "ENTITY_CHANGE_TRACKING"
+
+	-- Benchmarks of the Context, with its counters enabled. Build the Release configuration for
+	-- meaningful timings.
+	project "Bench"
+		kind "ConsoleApp"
+		files { "**.h", "**.cpp" }
+		removefiles { "main.cpp" }
+		defines "ENTITY_COUNTERS"